@@ -0,0 +1,124 @@
+/*
+ * parse_bench - Time tsh's command line parser, and print what it makes
+ *    of each line, so that two versions of tsh.c can be compared. The
+ *    shell is compiled into this file with its main renamed; TSH_OLD
+ *    selects the parseline(cmdline, argv, cmds, &ncmds) of the shell
+ *    before lexline (27248eb^), otherwise lexline + parseline are used.
+ *
+ *    git show 27248eb^:tsh.c > /tmp/old_tsh.c
+ *    gcc -O2 -DTSH_OLD -DTSH_SRC='"/tmp/old_tsh.c"' -o /tmp/pb_old bench/parse_bench.c
+ *    gcc -O2 -o /tmp/pb_new bench/parse_bench.c
+ *    /tmp/pb_old > /tmp/old.out; /tmp/pb_new > /tmp/new.out
+ *    diff <(grep -v ns/call /tmp/old.out) <(grep -v ns/call /tmp/new.out)
+ *
+ *    /tmp/pb_new -s times the scalar scanner instead of the SSE2/AVX2 one.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#ifndef TSH_SRC
+#define TSH_SRC "../tsh.c"
+#endif
+#define main tsh_main
+#include TSH_SRC
+#undef main
+
+#define BENCH_ITERS 200000
+
+static char bench_lines[3][MAXLINE];     /* the old parser takes at most MAXLINE */
+static const char *bench_names[3] = { "40-byte pipeline", "60 args", "quoted" };
+
+/* bench_make - The lines every version can parse: no double quotes, no ';' */
+static void bench_make(){
+    char *p;
+    int i;
+
+    strcpy(bench_lines[0], "cat in.txt | grep -v foo | wc -l > out &\n");
+
+    p = bench_lines[1];
+    for(i = 0; i < 60; i++){
+        p += sprintf(p, "argument%02d%s ", i, i % 3 ? "" : "-longer");
+    }
+    strcpy(p, "2>>err.log\n");
+
+    p = bench_lines[2];
+    for(i = 0; i < 20; i++){
+        p += sprintf(p, "'quoted %02d with | and >' plain%02d ", i, i);
+    }
+    strcpy(p, "| tee 'a file'\n");
+}
+
+/* bench_print - Show the stages, arguments and redirections of a parse */
+static void bench_print(int bg, struct cmd_t *cmds, int ncmds){
+    printf("  bg=%d stages=%d\n", bg, ncmds);
+    for(int i = 0; i < ncmds; i++){
+        printf("  [%d]", i);
+        for(char **a = cmds[i].argv; *a != NULL; a++){
+            printf(" <%s>", *a);
+        }
+        for(int r = 0; r < cmds[i].nredirs; r++){
+            struct redir_t *d = &cmds[i].redirs[r];
+            if(d->file != NULL){
+                printf(" {%d flags=%#x %s}", d->fd, d->flags, d->file);
+            }else{
+                printf(" {%d dup %d}", d->fd, d->src);
+            }
+        }
+        printf("\n");
+    }
+}
+
+#ifdef TSH_OLD
+static int bench_parse(const char *line, int print){
+    static char *argv[MAXARGS];
+    static struct cmd_t cmds[MAXSTAGES];
+    int ncmds, bg = parseline(line, argv, cmds, &ncmds);
+
+    if(print && bg >= 0){
+        bench_print(bg, cmds, ncmds);
+    }
+    return bg;
+}
+#else
+static int bench_parse(const char *line, int print){
+    struct arena_mark_t mark = arena_mark();
+    struct token_t *toks;
+    struct cmd_t *cmds;
+    char **argv;
+    int ncmds, bg = -1;
+
+    if(lexline(line, &toks) >= 0){
+        bg = parseline(&toks, &argv, &cmds, &ncmds);
+        if(print && bg >= 0){
+            bench_print(bg, cmds, ncmds);
+        }
+    }
+    arena_release(mark);
+    return bg;
+}
+#endif
+
+int main(int argc, char **argv){
+#ifndef TSH_OLD
+    init_lexer();
+    if(argc > 1 && strcmp(argv[1], "-s") == 0){
+        scan_special = scan_scalar;
+    }
+#endif
+    bench_make();
+    for(int i = 0; i < 3; i++){
+        const char *line = bench_lines[i];
+        struct timespec a, b;
+        volatile int sink = 0;
+
+        printf("%s (%zu bytes)\n", bench_names[i], strlen(line));
+        bench_parse(line, 1);
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        for(int k = 0; k < BENCH_ITERS; k++){
+            sink += bench_parse(line, 0);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        printf("  %.0f ns/call\n",
+               ((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec)) / BENCH_ITERS);
+    }
+    return 0;
+}
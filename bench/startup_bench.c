@@ -0,0 +1,179 @@
+/*
+ * startup_bench - Time how long tsh takes to start and log in, with the
+ *    credentials given at the prompts and with TSH_AUTH. Run it where
+ *    tsh runs (./etc/passwd is read from the current directory):
+ *
+ *    gcc -O2 -o tsh tsh.c
+ *    gcc -O2 -o /tmp/startup_bench bench/startup_bench.c
+ *    /tmp/startup_bench ./tsh root:pass
+ *
+ *    Sequential: from fork to the output of the first command, for
+ *      - prompts, credentials written ahead on stdin
+ *      - prompts, each answered once it is shown (a driver that waits)
+ *      - TSH_AUTH
+ *    Batch: BATCH_N runs of "tsh -c true", BATCH_WAY at a time, with
+ *    the credentials on stdin and with TSH_AUTH.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define SEQ_N     1000  /* sequential starts per mode */
+#define BATCH_N   2000  /* shells per batch run */
+#define BATCH_WAY   64  /* of which at most this many at once */
+
+#define MODE_AHEAD  0   /* credentials on stdin before the shell asks */
+#define MODE_WAIT   1   /* each prompt answered when it appears */
+#define MODE_TOKEN  2   /* TSH_AUTH */
+
+static char *tsh, *token, user[256], pass[256];
+
+static double now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void die(char *msg){
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/* start - Run tsh with argv, stdin from *in (a pipe, or /dev/null if in is NULL), stdout to *out */
+static pid_t start(char **argv, int *in, int *out, int use_token){
+    int ip[2], op[2];
+    pid_t pid;
+
+    if(pipe2(ip, O_CLOEXEC) < 0 || (out != NULL && pipe2(op, O_CLOEXEC) < 0)){
+        die("pipe");
+    }
+    if((pid = fork()) < 0){
+        die("fork");
+    }
+    if(pid == 0){
+        int null = open("/dev/null", O_RDWR);
+        dup2(in != NULL ? ip[0] : null, 0);
+        dup2(out != NULL ? op[1] : null, 1);
+        if(use_token){
+            setenv("TSH_AUTH", token, 1);
+        }else{
+            unsetenv("TSH_AUTH");
+        }
+        execv(tsh, argv);
+        _exit(127);
+    }
+    close(ip[0]);
+    if(in != NULL){
+        *in = ip[1];
+    }else{
+        close(ip[1]);
+    }
+    if(out != NULL){
+        close(op[1]);
+        *out = op[0];
+    }
+    return pid;
+}
+
+/* wait_for - Read from fd until what has been seen; buf keeps what came after it */
+static void wait_for(int fd, char *buf, size_t *len, const char *what){
+    char *hit;
+    ssize_t n;
+
+    while((hit = memmem(buf, *len, what, strlen(what))) == NULL){
+        if((n = read(fd, buf + *len, 4095 - *len)) <= 0){
+            fprintf(stderr, "tsh ended before \"%s\"\n", what);
+            exit(1);
+        }
+        *len += n;
+    }
+    *len -= hit + strlen(what) - buf;
+    memmove(buf, hit + strlen(what), *len);
+}
+
+static double sequential(int mode){
+    char *argv[] = { tsh, "-p", NULL };
+    char creds[600], buf[4096];
+    double total = 0;
+
+    snprintf(creds, sizeof(creds), "%s\n%s\n", user, pass);
+    for(int i = 0; i < SEQ_N; i++){
+        size_t len = 0;
+        int in, out;
+        double t = now();
+        pid_t pid = start(argv, &in, &out, mode == MODE_TOKEN);
+
+        if(mode == MODE_AHEAD){
+            dprintf(in, "%s", creds);
+        }else if(mode == MODE_WAIT){
+            wait_for(out, buf, &len, "username: ");
+            dprintf(in, "%s\n", user);
+            wait_for(out, buf, &len, "password: ");
+            dprintf(in, "%s\n", pass);
+        }
+        dprintf(in, "/bin/echo bench-ok\n");
+        wait_for(out, buf, &len, "bench-ok\n");
+        total += now() - t;
+
+        close(in);
+        close(out);
+        waitpid(pid, NULL, 0);
+    }
+    return total / SEQ_N;
+}
+
+static double batch(int use_token){
+    char *argv[] = { tsh, "-c", "true", NULL };
+    char creds[600];
+    int live = 0;
+    double t = now();
+
+    snprintf(creds, sizeof(creds), "%s\n%s\n", user, pass);
+    for(int i = 0; i < BATCH_N; i++){
+        if(live == BATCH_WAY){
+            wait(NULL);
+            live--;
+        }
+        if(use_token){
+            start(argv, NULL, NULL, 1);
+        }else{
+            int in;
+            start(argv, &in, NULL, 0);
+            dprintf(in, "%s", creds);
+            close(in);
+        }
+        live++;
+    }
+    while(live-- > 0){
+        wait(NULL);
+    }
+    return (now() - t) / BATCH_N;
+}
+
+int main(int argc, char **argv){
+    char *colon;
+
+    if(argc != 3 || (colon = strchr(argv[2], ':')) == NULL){
+        fprintf(stderr, "usage: %s path/to/tsh user:password\n", argv[0]);
+        return 1;
+    }
+    tsh = argv[1];
+    token = argv[2];
+    snprintf(user, sizeof(user), "%.*s", (int)(colon - token), token);
+    snprintf(pass, sizeof(pass), "%s", colon + 1);
+
+    printf("to the first command, %d sequential starts:\n", SEQ_N);
+    printf("  %-26s %6.0f us\n", "prompts, written ahead", sequential(MODE_AHEAD) * 1e6);
+    printf("  %-26s %6.0f us\n", "prompts, answered in turn", sequential(MODE_WAIT) * 1e6);
+    printf("  %-26s %6.0f us\n", "TSH_AUTH", sequential(MODE_TOKEN) * 1e6);
+    printf("tsh -c true, %d shells, %d at a time:\n", BATCH_N, BATCH_WAY);
+    printf("  %-26s %6.0f us/shell\n", "credentials on stdin", batch(0) * 1e6);
+    printf("  %-26s %6.0f us/shell\n", "TSH_AUTH", batch(1) * 1e6);
+    return 0;
+}
@@ -3,6 +3,7 @@
  * 
  * <Put your name and login ID here>
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,15 +12,46 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <spawn.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <stdio_ext.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEX_X86 1         /* the lexer has SSE2 and AVX2 scanners */
+#endif
 
 /* Misc manifest constants */
-#define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
-#define MAXJID    1<<16   /* max job ID */
-#define MAXHISTORY   10   /* max records of history */ 
+#define MAXLINE    1024   /* max size of a name or path */
+#define JOBS_INIT    64   /* job list slots to start with, a multiple of 64 */
+#define MAXJID  (1<<16)   /* max job ID */
+#define PASSWD_PATH "./etc/passwd"
+#define PASSWD_DB   "./etc/passwd.cdb"  /* the index of PASSWD_PATH */
+#define CDB_HEADER  2048  /* 256 (position, length) pairs */
+#define ADDUSER_THREADS 16  /* most threads adduser -f makes homes with */
+#define HISTSIZE   1000   /* commands the history shows by default */
+#define HIST_MAPMIN (1<<20) /* the history log is mapped in multiples of this */
+#define PS_DONE      32   /* finished jobs ps remembers */
+#define HIST_SUB_BITS 4   /* a histogram splits each power of 2 in 1<<HIST_SUB_BITS */
+#define HIST_SLOTS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS) 
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -27,6 +59,65 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
+/* Launch strategies for external commands (see launch) */
+#define LAUNCH_FORK  0  /* fork, setpgid and execve in the child */
+#define LAUNCH_SPAWN 1  /* posix_spawn with POSIX_SPAWN_SETPGROUP */
+#define LAUNCH_VFORK 2  /* clone(CLONE_VM|CLONE_VFORK), then execve */
+#define LAUNCH_STACK (64*1024) /* stack size of a LAUNCH_VFORK child */
+
+/* Where the shell records its processes (see add_proc) */
+#define PROC_FILES 0    /* one ./proc/<pid>/status file per process */
+#define PROC_SHM   1    /* a slot per process in the shared registry REG_PATH */
+#define PROC_SLOTS 4096 /* slots in a new registry */
+#define REG_PATH "./proc/.registry"
+#define PROC_NAMEW  31  /* width of Name in a status file, longer names are cut */
+#define PROC_NUMW   10  /* width of Pid, PPid, PGid and Sid */
+#define PROC_STATW   4  /* width of STAT */
+#define PROC_STAT_OFF (6 + PROC_NAMEW + 1 + 5 + PROC_NUMW + 1 + 6 + PROC_NUMW + 1 \
+                       + 6 + PROC_NUMW + 1 + 5 + PROC_NUMW + 1 + 6) /* where STAT's value is */
+#define PROC_FDCACHE 256 /* status files kept open at most */
+#define PROC_FLUSH_MS 10  /* a wait longer than this writes out pending records */
+
+/* Record changes not written out yet (see flush_procs) */
+#define PROC_NEW   1    /* the record is to be created */
+#define PROC_DIRTY 2    /* its STAT changed */
+#define PROC_GONE  4    /* it is to be removed */
+
+#define CMDHASH_SIZE 64   /* buckets in the command hash (power of 2) */
+#define RELAY_CHUNK (64*1024) /* bytes moved per round by the tee relay */
+#define REDIR_FDMIN 10    /* files opened for redirections are moved to >= this */
+#define BATCH_BUFSIZE (64*1024) /* stdout buffer in script and -c mode */
+#define INBUF_SIZE 4096   /* first size of the stdin buffer */
+#define SIGBATCH     16   /* signalfd records read at a time */
+#define ARENA_BLOCK (64*1024) /* usual size of an arena block */
+
+/* Token types */
+#define TOK_END    0  /* end of the line */
+#define TOK_WORD   1  /* a word, quotes and escapes removed */
+#define TOK_PIPE   2  /* | */
+#define TOK_AMP    3  /* & */
+#define TOK_SEMI   4  /* ; */
+#define TOK_IN     5  /* [n]< */
+#define TOK_OUT    6  /* [n]> */
+#define TOK_APPEND 7  /* [n]>> */
+#define TOK_DUP    8  /* [n]>&m or [n]<&m */
+
+/*
+ * Builtins are found through builtins[], a perfect hash table indexed by
+ * BUILTIN_HASH of the first and last characters of the name and its
+ * length. The slot of every entry is computed by the compiler, and two
+ * builtins in the same slot are a compile error in builtin_hash_check
+ * (duplicate case value): change BUILTIN_MULT or BUILTIN_SLOTS then.
+ */
+#define BUILTIN_SLOTS 64  /* size of builtins[] (power of 2) */
+#define BUILTIN_MULT   1
+#define BUILTIN_HASH(first, last, len) \
+    (((first) + (last) * BUILTIN_MULT + (len)) & (BUILTIN_SLOTS - 1))
+
+/* Builtin flags */
+#define BI_ROOT 1   /* only root may run it */
+#define BI_ANY -1   /* as maxargs: any number of arguments */
+
 /* 
  * Jobs states: FG (foreground), BG (background), ST (stopped)
  * Job state transitions and enabling actions:
@@ -41,21 +132,234 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
-int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 char * username;            /* The name of the user currently logged into the shell */
 struct job_t {              /* The job struct */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (the process group leader) */
+    pid_t *pids;            /* every process of the job, 0 once reaped */
+    int npids;              /* number of entries in pids */
+    int pidcap;             /* room in pids */
+    int nlive;              /* processes not reaped yet */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    char *cmdline;          /* command line */
+    size_t cmdcap;          /* room in cmdline */
+    struct timespec start;  /* when it was started (CLOCK_MONOTONIC) */
+    struct rusage ru;       /* usage of its processes reaped so far */
+};
+struct donejob_t {          /* A finished job, kept for ps */
+    int jid;
+    pid_t pid;
+    double wall;            /* seconds from start to the last exit */
+    struct rusage ru;       /* usage of all its processes */
+    char *cmdline;
+    size_t cmdcap;
+};
+struct hist_t {             /* A log-linear histogram of latencies in ns */
+    char *name;
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint32_t slots[HIST_SLOTS];
+};
+struct hist_t hist_parse = { "parse" };      /* lexing and parsing a line */
+struct hist_t hist_spawn = { "spawn" };      /* starting every process of a job */
+struct hist_t hist_fg = { "foreground" };    /* start of a foreground job to its end */
+struct donejob_t donejobs[PS_DONE]; /* ring of the last PS_DONE finished jobs */
+unsigned long ndone;        /* jobs finished so far, donejobs[ndone % PS_DONE] is next */
+struct pident_t {           /* One pidhash entry */
+    pid_t pid;              /* 0 for an empty entry */
+    int jid;                /* job the process belongs to */
+};
+struct job_t *jobs;         /* The job list, indexed by jid (jobs[0] is unused) */
+int jobcap;                 /* slots in jobs, a multiple of 64 */
+uint64_t *jidmap;           /* bit jid is set while jid is in use, bit 0 always */
+int topjid;                 /* largest jid in use, 0 if none */
+int jidhint;                /* the words of jidmap before this one are full */
+int fgjid;                  /* jid of the foreground job, 0 if none */
+int nrunning;               /* jobs in FG or BG */
+int nstopped;               /* jobs in ST */
+struct pident_t *pidhash;   /* pid -> jid for the processes of every job */
+int pidhashcap;             /* entries in pidhash, a power of 2 */
+int npidhash;               /* entries in use */
+struct redir_t {            /* One redirection: [fd]<file, [fd]>file, [fd]>>file or [fd]>&src */
+    int fd;                 /* descriptor being redirected */
+    char *file;             /* file to open, NULL for [fd]>&src */
+    int flags;              /* open flags for file */
+    int src;                /* descriptor fd becomes a copy of (opened by open_redirs) */
+};
+struct cmd_t {              /* One stage of a pipeline */
+    char **argv;            /* NULL-terminated argument list */
+    struct redir_t *redirs; /* its redirections, in the order given */
+    int nredirs;
+};
+struct dupfd_t {            /* dup2(fd, target) in a child */
+    int fd;
+    int target;
+};
+struct vfork_args {         /* handed to a LAUNCH_VFORK child */
+    char *path;             /* file to execve */
+    char **argv;            /* command to execve */
+    sigset_t *mask;         /* signal mask to install before execve */
+    pid_t pgid;             /* process group to join, 0 for a new one */
+    struct dupfd_t *dups;   /* descriptors to set up before execve */
+    int ndups;
+    int err;                /* errno of a failed execve, set by the child */
+};
+struct token_t {            /* A token of the command line */
+    int type;               /* TOK_WORD, TOK_PIPE, ... */
+    char *text;             /* TOK_WORD: the word itself */
+    int fd;                 /* redirections: the descriptor redirected */
+    int src;                /* TOK_DUP: the descriptor it becomes a copy of */
+    const char *begin;      /* where the token is in the command line */
+    const char *end;
+};
+struct arena_block_t {      /* A block of the arena */
+    struct arena_block_t *next;
+    size_t size;            /* bytes in data */
+    size_t used;            /* bytes handed out */
+    char data[] __attribute__((aligned(16)));
+};
+struct arena_mark_t {       /* A point to release the arena back to */
+    struct arena_block_t *block;
+    size_t used;
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
-/* where to store the next history record
-indicate the position of the oldest command as well (if there is a command at history_idx)*/
-int history_idx = 0;        
-char history[MAXHISTORY][MAXLINE];  /* the last 10 records of history */
+struct builtin_t {          /* A builtin command */
+    char *name;
+    void (*fn)(char **argv); /* runs it */
+    int minargs;            /* arguments it needs after its name */
+    int maxargs;            /* arguments it takes, or BI_ANY */
+    int flags;              /* BI_ROOT */
+};
+struct regslot_t {          /* One process in the shared registry */
+    uint32_t seq;           /* odd while the owner is changing the slot */
+    int32_t pid;            /* 0 never used, -1 free again, -2 being filled in */
+    int32_t ppid;
+    int32_t pgid;
+    int32_t sid;            /* the tsh that owns the slot */
+    uint64_t sstart;        /* and when it started (proc_start), as its pid may be reused */
+    char stat[8];
+    char name[PROC_NAMEW + 1]; /* truncated */
+    char user[32];
+};
+struct registry_t {         /* The shared registry file, mapped */
+    uint32_t nslots;
+    uint32_t slotsize;      /* sizeof(struct regslot_t) of the tsh that made it */
+    struct regslot_t slots[];
+};
+struct procent_t {          /* The shell's handle on the record of one of its processes */
+    pid_t pid;              /* 0 for an empty entry */
+    int ref;                /* its registry slot, or its status file open, or -1 */
+    int pending;            /* PROC_NEW, PROC_DIRTY, PROC_GONE */
+    pid_t ppid;             /* the fields for PROC_NEW and PROC_DIRTY */
+    pid_t pgid;
+    char stat[PROC_STATW + 1];
+    char wstat[PROC_STATW + 1]; /* the STAT last written */
+    char name[PROC_NAMEW + 1];
+};
+struct cmdhash_t {          /* A remembered PATH lookup */
+    char *name;             /* command name as typed */
+    char *path;             /* where it was found, NULL if nowhere */
+    int dir;                /* index of the PATH directory it was found in */
+    int hits;               /* times the entry was used */
+    struct cmdhash_t *next; /* next entry in the same bucket */
+};
+struct cmdhash_t * cmdhash[CMDHASH_SIZE]; /* command name -> path */
+struct pathdir_t {          /* A PATH directory and its mtime when hashed */
+    char *dir;
+    struct timespec mtime;
+};
+struct pathdir_t * pathdirs;    /* the directories of pathenv, in order */
+int npathdirs;
+char * pathenv;             /* the PATH the command hash was built for */
+struct arena_block_t * arena_first; /* the arena, for memory that lives as long */
+struct arena_block_t * arena_cur;   /* as one command line (see arena_alloc) */
+/* byte classes for the lexer: 1 for bytes that end a plain run of a word */
+const unsigned char lex_special[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\''] = 1, ['"'] = 1, ['\\'] = 1,
+    ['&'] = 1, ['|'] = 1, ['<'] = 1, ['>'] = 1, [';'] = 1,
+};
+const char *(*scan_special)(const char *p, const char *end); /* picked by init_lexer */
+struct history_t {          /* The history (see history_map) */
+    int fd;                 /* the log, opened O_APPEND */
+    int ifd;                /* inotify on the home directory, -1 if none */
+    char *text;             /* the log mapped: one command per line */
+    size_t len, maplen;     /* bytes in the log, and mapped */
+    size_t start;           /* where the oldest command indexed starts */
+    size_t *off;            /* off[lo..n): where the last commands start in text */
+    size_t lo, n, offcap;
+    long idbase;            /* the id of off[i] is i + idbase */
+    size_t size;            /* how many of the last ones are shown */
+} histlog = { .fd = -1, .ifd = -1, .size = HISTSIZE };
+struct pwstamp_t {          /* The passwd an index was built from */
+    uint64_t dev, ino, size;
+    int64_t sec, nsec;      /* mtime */
+};
+struct pwdb_t {             /* The passwd index, mapped */
+    char *map;
+    size_t size;
+    struct pwstamp_t stamp; /* what passwd was when it was checked */
+} pwdb;
+struct newuser_t {          /* A user adduser -f is adding */
+    char *name, *pass;
+    int err;                /* errno from making the home, 0 if made */
+};
+struct userbatch_t {        /* The users adduser -f is adding */
+    struct newuser_t *users;
+    size_t n;
+    size_t next;            /* the next one a thread takes */
+};
+struct intern_t {           /* A command interned */
+    uint64_t hash;
+    size_t text;            /* where it is in histlog.text, + 1; 0 for a free slot */
+    size_t len;
+    size_t off;             /* where the log has it */
+};
+struct interns_t {          /* A table of interned commands */
+    struct intern_t *slots;
+    size_t cap, n;          /* cap is a power of 2 */
+};
+struct interns_t interns;   /* the commands of the log that are indexed (see history_text) */
+struct trigram_t {          /* The commands of the history three bytes are in */
+    uint32_t key;           /* the bytes, + 1: 0 is a free slot */
+    uint32_t n, cap;
+    uint32_t *ids;          /* ascending */
+};
+struct trigram_t *trigrams; /* trigram index of the history (see history_search) */
+uint32_t trigramcap;        /* a power of 2 */
+uint32_t ntrigrams;
+int trigram_built;          /* whether it covers the history yet */
+int edit_mode;              /* stdin is a terminal: lines are read by edit_line */
+int expand_mode;            /* expand history references: in the read loop, not -c or scripts */
+struct termios tty_mode;    /* the terminal settings to run commands with */
 int shell_pid;
+uint64_t shell_start;       /* proc_start(shell_pid), kept in the registry slots we own */
+int launch_mode = LAUNCH_SPAWN; /* how external commands are started */
+int proc_mode = PROC_FILES; /* how processes are recorded */
+struct registry_t *reg;     /* the shared registry (PROC_SHM) */
+uint32_t regslots;          /* slots in reg */
+struct procent_t *procs;    /* pid -> registry slot or status file, for our own processes */
+uint32_t proccap;           /* entries in procs, a power of 2 */
+uint32_t nprocs;            /* entries in use */
+int nprocfds;               /* status files held open in procs */
+pid_t *procdirty;           /* pids with pending changes, in the order they came */
+int ndirty;
+int dirtycap;
+unsigned long proc_writes;  /* changes written to the backend */
+unsigned long proc_coalesced; /* changes that never had to be */
+sigset_t shell_sigs;        /* signals the shell handles, blocked and read from sigfd */
+sigset_t child_mask;        /* the mask the shell started with, given to children */
+int sigfd;                  /* signalfd for shell_sigs */
+int sigepfd;                /* epoll set with sigfd */
+int inepfd = -1;            /* epoll set with sigfd and stdin, -1 if stdin can't be polled */
+struct inbuf_t {            /* stdin, read by read_line */
+    char *buf;
+    size_t cap;
+    size_t start;           /* first byte not returned yet */
+    size_t end;             /* end of the bytes read */
+    int eof;
+} inbuf;
 /* End global variables */
 
 
@@ -63,6 +367,7 @@ int shell_pid;
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
+void eval_job(char *cmdline, char **argv, struct cmd_t *cmds, int ncmds, int bg);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
 void waitfg(pid_t pid);
@@ -73,62 +378,230 @@ void sigint_handler(int sig);
 
 /* helper functions */
 void init_history();
+int cdb_find(const char *map, size_t size, const char *key, size_t klen, const char **data, uint32_t *dlen);
+void passwd_stamp(struct stat *st, struct pwstamp_t *stamp);
+void passwd_build(int fd, struct stat *st);
+void passwd_open();
 int exist_user(char * name, char password[]);
 int check_auth(char * name, char * passwd);
-int history_start();
+void history_dir(char *path, size_t size);
+void history_path(char *path, size_t size);
+void history_reopen();
+void history_sync();
+void history_events();
+void history_map();
+void history_room(int at);
+void history_scan(size_t want);
+void history_cover(size_t size);
+struct intern_t *intern_slot(struct interns_t *t, const char *s, size_t len, uint64_t h);
+size_t intern_get(struct interns_t *t, const char *s, size_t len);
+size_t intern(struct interns_t *t, const char *s, size_t len, size_t off);
+void intern_reset(struct interns_t *t);
+char * history_text(size_t off, size_t *len);
+void history_intern(size_t off);
 void add_history(char * cmdline);
-void save_history();
+size_t history_count();
 void list_history();
-char * nth_history(int n);
-void write_proc(char * name, pid_t pid, pid_t ppid, char * stat);
+char * nth_history(size_t n, size_t *len);
+void compact_history(int force);
+char * history_entry(size_t i, size_t *len);
+struct trigram_t *trigram_get(uint32_t key, int create);
+void trigram_post(uint32_t key, uint32_t id);
+void trigram_add(size_t i);
+void trigram_reset();
+void trigram_build();
+size_t history_search(const char *pat, size_t plen, size_t *hits);
+int format_status(char * buf, size_t size, char * name, pid_t pid, pid_t ppid, pid_t pgid,
+                  pid_t sid, char * stat, char * user);
+int write_proc(char * name, pid_t pid, pid_t ppid, pid_t pgid, char * stat);
 void change_proc_stat(pid_t pid, char * stat);
-void add_proc(char * name, pid_t pid, pid_t ppid, char * stat);
+void change_job_stat(struct job_t * job, char * stat);
+void add_proc(char * name, pid_t pid, pid_t ppid, pid_t pgid, char * stat);
+uint64_t proc_start(pid_t pid);
+int proc_stale(pid_t pid, struct stat *st);
+void reg_open();
+int reg_add(char * name, pid_t pid, pid_t ppid, pid_t pgid, char * stat);
+void reg_set_stat(int i, char * stat);
+void reg_remove(int i);
+int reg_read(uint32_t i, struct regslot_t *out);
+struct procent_t *proc_find(pid_t pid);
+struct procent_t *proc_new(pid_t pid);
+void proc_pend(struct procent_t *e, int what);
+void flush_procs();
+void proc_create(struct procent_t *e);
+void proc_write_stat(struct procent_t *e);
+void proc_unlink(struct procent_t *e);
+int read_status(const char * path, struct regslot_t * out);
+void proc_del(pid_t pid);
+void list_proc_files();
+int passwd_lock();
 void add_user(char ** argv);
-void nth_cmd(char ** argv);
-pid_t check_suspend();
-pid_t check_run();
+void *make_homes(void *arg);
+void add_users(char *file);
+long history_prefix(const char *pfx, size_t plen);
+char * history_word(char *s, size_t len, int n, char **end);
+char * expand_history(char *cmdline);
+int check_suspend();
+int check_run();
 void do_quit();
 struct job_t * pidjid_str2job(char * str);
 void remove_proc(pid_t pid);
+pid_t launch(char *path, char **argv, sigset_t *mask, pid_t pgid, struct dupfd_t *dups, int ndups);
+void launch_error(char *argv0, int err);
+int is_relay(char ** argv);
+pid_t relay(char **argv, sigset_t *mask, pid_t pgid, struct dupfd_t *dups, int ndups);
+int tee_relay(char ** argv);
+int move_bytes(int from, int to, size_t n);
+int open_redirs(struct cmd_t *cmds, int ncmds);
+void close_redirs(struct cmd_t *cmds, int ncmds);
+int builtin_redir(struct cmd_t *cmd);
+void run_batch(const char *buf, size_t len);
+void run_script(char *path);
+void serve(char *path);
+char * find_cmd(char * name);
+void load_path();
+int path_changed(int upto);
+void hash_reset();
+void list_hash();
+void do_hash(char ** argv);
+int vfork_child(void *arg);
 /* end helper functions */
 
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int parseline(struct token_t **tokp, char ***argvp, struct cmd_t **cmdsp, int *ncmds); 
+int lexline(const char *cmdline, struct token_t **toks);
+const char *lex_redir(const char *p, const char *end, struct token_t *t, int fd);
+const char *lex_dquote(const char *p, const char *end, char **dst);
+void init_lexer();
+const char *scan_scalar(const char *p, const char *end);
+void *arena_alloc(size_t n);
+char *arena_strdup(const char *s);
+struct arena_mark_t arena_mark();
+void arena_release(struct arena_mark_t mark);
 void sigquit_handler(int sig);
+void init_events();
+void dispatch_signals();
+int wait_events(int epfd);
+ssize_t read_line(char **lineptr, size_t *cap);
+void fill_inbuf();
+int read_key();
+void line_room(char **lineptr, size_t *cap, size_t len);
+void line_set(char **lineptr, size_t *cap, const char *s, size_t len);
+void skip_escape();
+int reverse_search(char **lineptr, size_t *cap, size_t *len);
+ssize_t edit_line(char **lineptr, size_t *cap);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int maxjid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void initjobs();
+void growjobs(int cap);
+int alloc_jid();
+void free_jid(int jid);
+void pidhash_reserve(int n);
+void pidhash_put(pid_t pid, int jid);
+int pidhash_get(pid_t pid);
+void pidhash_del(pid_t pid);
+void setjobstate(struct job_t *job, int state);
+int addjob(pid_t pid, pid_t *pids, int npids, int state, char *cmdline);
+int deletejob(pid_t pid); 
+pid_t fgpid();
+struct job_t *getjobpid(pid_t pid);
+struct job_t *getjobjid(int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void listjobs();
 char * login();
+char * auth_login(int fd);
 void usage(void);
 void unix_error(char *msg);
 void app_error(char *msg);
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
 
+/* builtin handlers */
+void builtin_jobs(char **argv);
+void builtin_history(char **argv);
+void builtin_logout(char **argv);
+void builtin_quit(char **argv);
+void builtin_proc(char **argv);
+void builtin_ps(char **argv);
+void ru_add(struct rusage *to, const struct rusage *from);
+int sample_proc(pid_t pid, double *user, double *sys, long *rsskb);
+void builtin_time(char **argv);
+void builtin_stats(char **argv);
+uint64_t now_ns();
+void hist_add(struct hist_t *h, uint64_t ns);
+uint64_t hist_value(int slot);
+uint64_t hist_percentile(struct hist_t *h, double p);
+void print_time(uint64_t ns, struct rusage *ru);
+void print_self_time(uint64_t ns, struct rusage *self);
+struct rusage *job_rusage(pid_t pgid);
+struct builtin_t *find_builtin(char *name);
+void check_builtins();
+
+/*
+ * The builtin commands: name, its first and last characters, handler,
+ * minimum and maximum number of arguments, flags. The characters have
+ * to be spelled out for BUILTIN_HASH to be a constant; check_builtins
+ * makes sure they match the name.
+ */
+#define BUILTIN_LIST(X) \
+    X("bg",      'b', 'g', do_bgfg,         1, 1,      0)       \
+    X("fg",      'f', 'g', do_bgfg,         1, 1,      0)       \
+    X("jobs",    'j', 's', builtin_jobs,    0, 0,      0)       \
+    X("hash",    'h', 'h', do_hash,         0, 1,      0)       \
+    X("adduser", 'a', 'r', add_user,        2, 2,      BI_ROOT) \
+    X("history", 'h', 'y', builtin_history, 0, BI_ANY, 0)       \
+    X("logout",  'l', 't', builtin_logout,  0, BI_ANY, 0)       \
+    X("quit",    'q', 't', builtin_quit,    0, BI_ANY, 0)       \
+    X("proc",    'p', 'c', builtin_proc,    0, 1,      0)       \
+    X("ps",      'p', 's', builtin_ps,      0, 1,      0)       \
+    X("time",    't', 'e', builtin_time,    0, 0,      0)       \
+    X("stats",   's', 's', builtin_stats,   0, 1,      0)
+
+#define BUILTIN_ENTRY(name, first, last, fn, min, max, flags) \
+    [BUILTIN_HASH(first, last, sizeof(name) - 1)] = { name, fn, min, max, flags },
+#define BUILTIN_CASE(name, first, last, fn, min, max, flags) \
+    case BUILTIN_HASH(first, last, sizeof(name) - 1):
+
+struct builtin_t builtins[BUILTIN_SLOTS] = { BUILTIN_LIST(BUILTIN_ENTRY) };
+
+/* builtin_hash_check - Never called, only compiled to catch collisions */
+void builtin_hash_check(int slot){
+    switch(slot){
+    BUILTIN_LIST(BUILTIN_CASE)
+        break;
+    }
+}
+
+#define BUILTIN_VERIFY(name, first, last, fn, min, max, flags) \
+    if((name)[0] != (first) || (name)[sizeof(name) - 2] != (last)) \
+        app_error("builtin \"" name "\": first or last character does not match its name");
+
+/* check_builtins - Stop if an entry of BUILTIN_LIST would hash to the wrong slot */
+void check_builtins(){
+    BUILTIN_LIST(BUILTIN_VERIFY)
+}
+
 /*
  * main - The shell's main routine 
  */
 int main(int argc, char **argv) 
 {
     char c;
-    char cmdline[MAXLINE];
+    char *cmdline = NULL;     /* grown by read_line as needed */
+    size_t cmdcap = 0;
     int emit_prompt = 1; /* emit prompt (default) */
+    char *command = NULL; /* -c argument */
+    char *script = NULL;  /* script file to run */
+    char *sockpath = NULL; /* -d socket */
+    int authfd = -1;      /* -a descriptor to read "user:password" from */
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpl:c:r:H:d:a:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -139,33 +612,102 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'l':             /* choose how external commands are started */
+            if (strcmp(optarg, "fork") == 0)
+                launch_mode = LAUNCH_FORK;
+            else if (strcmp(optarg, "spawn") == 0)
+                launch_mode = LAUNCH_SPAWN;
+            else if (strcmp(optarg, "vfork") == 0)
+                launch_mode = LAUNCH_VFORK;
+            else
+                usage();
+	    break;
+        case 'r':             /* choose where processes are recorded */
+            if (strcmp(optarg, "files") == 0)
+                proc_mode = PROC_FILES;
+            else if (strcmp(optarg, "shm") == 0)
+                proc_mode = PROC_SHM;
+            else
+                usage();
+	    break;
+        case 'H':             /* how many commands the history shows */
+            if ((histlog.size = strtoul(optarg, NULL, 10)) == 0)
+                usage();
+	    break;
+        case 'c':             /* run a command line instead of reading stdin */
+            command = optarg;
+	    break;
+        case 'd':             /* serve sessions on a Unix socket */
+            sockpath = optarg;
+	    break;
+        case 'a':             /* log in with the token on a descriptor */
+            if (!isdigit((unsigned char)optarg[0]))
+                usage();
+            authfd = atoi(optarg);
+	    break;
 	    default:
             usage();
 	    }
     }
+    if (optind < argc) {      /* tsh script.tsh */
+        if (command != NULL || optind + 1 < argc)
+            usage();
+        script = argv[optind];
+    }
+    if (sockpath != NULL && (command != NULL || script != NULL || authfd >= 0))
+        usage();
+
+    /* Batch output only has to be ordered with the children's, so it
+     * is flushed before starting one (see eval) instead of per line */
+    if (command != NULL || script != NULL)
+        setvbuf(stdout, NULL, _IOFBF, BATCH_BUFSIZE);
+
+    /* A builtin typed in wrong would only be found on PATH */
+    check_builtins();
+
+    /* As a daemon, only the sessions get past here, one process each,
+     * and each logs in at the prompts */
+    if (sockpath != NULL) {
+        unsetenv("TSH_AUTH");
+        serve(sockpath);
+    }
 
-    /* Install the signal handlers */
-
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
-
-    /* This one provides a clean way to kill the shell */
-    Signal(SIGQUIT, sigquit_handler); 
+    /* Take ctrl-c, ctrl-z, child events and SIGQUIT through signalfd */
+    init_events();
 
     /* Initialize the job list */
-    initjobs(jobs);
+    initjobs();
+
+    /* Pick the fastest scanner the CPU has */
+    init_lexer();
 
-    /* Have a user log into the shell */
-    username = login();
+    /* Have a user log into the shell, with -a or TSH_AUTH if given */
+    username = auth_login(authfd);
 
     shell_pid = getpid();
-    add_proc("tsh", shell_pid, getppid(), "Rs+");
+    if (proc_mode == PROC_SHM)
+        reg_open();
+    add_proc("tsh", shell_pid, getppid(), shell_pid, "Rs+");
     
     /* Init history for the user that has logged in */
     init_history();
+
+    /* Run the -c command or the script and leave as quit would */
+    if (command != NULL) {
+        run_batch(command, strlen(command));
+        do_quit();
+    }
+    if (script != NULL) {
+        run_script(script);
+        do_quit();
+    }
     
+    /* At a terminal, edit the line in the shell for ctrl-r */
+    edit_mode = emit_prompt && isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &tty_mode) == 0;
+
+    /* Only lines typed at the shell go through history expansion */
+    expand_mode = 1;
+
     /* Execute the shell's read/eval loop */
     while (1) {
 
@@ -174,9 +716,9 @@ int main(int argc, char **argv)
             printf("%s", prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
+        if ((edit_mode ? edit_line(&cmdline, &cmdcap)
+                       : read_line(&cmdline, &cmdcap)) < 0) { /* End of file (ctrl-d) */
+            flush_procs();
             fflush(stdout);
             exit(0);
         }
@@ -184,61 +726,436 @@ int main(int argc, char **argv)
 
         /* Evaluate the command line */
         eval(cmdline);
-        fflush(stdout);
+        flush_procs();
         fflush(stdout);
     } 
 
     exit(0); /* control never reaches here */
 }
 
-void init_history(){  
-    char path[MAXLINE];
-    sprintf(path, "./home/%s/.tsh_history", username);
+/*
+ * run_script - Run the script at path. It is mapped rather than read,
+ *    so its lines are split straight out of the page cache.
+ */
+void run_script(char *path){
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) < 0){
+        unix_error(path);
+    }
+    if(st.st_size == 0){
+        close(fd);
+        return;
+    }
 
-    FILE * fp = fopen(path, "r");
-    if(fp == NULL){
-        unix_error("fopen");
+    char * buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(buf == MAP_FAILED){
+        unix_error("mmap error");
     }
+    close(fd);
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+    run_batch(buf, st.st_size);
+    munmap(buf, st.st_size);
+}
+
+/*
+ * serve - Run as a daemon taking sessions on the Unix socket at path
+ *    (tsh -d). Each connection gets a process of its own, forked from
+ *    here with the passwd index mapped and PATH loaded, so a session
+ *    costs a fork instead of a tsh start and an index check. Sessions
+ *    keep their own job list and process groups (each is a session of
+ *    its own, setsid), and share passwd and the history logs with the
+ *    others through the files. Returns only in a session, with the
+ *    connection as stdin, stdout and stderr.
+ */
+void serve(char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event ev = { .events = EPOLLIN }, evs[2];
+    struct signalfd_siginfo si[SIGBATCH];
+    sigset_t sigs, old;
+    int lfd, sfd, epfd, cfd, n;
+    pid_t pid;
 
-    int i = 0;
-    while(fgets(history[i], MAXLINE, fp) != NULL){
-        i++;        
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        app_error("socket path too long");
+    }
+    strcpy(addr.sun_path, path);
+    if((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0){
+        unix_error("socket error");
+    }
+    if(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        // left by a daemon that died, unless one still answers on it
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(errno != EADDRINUSE || probe < 0 ||
+           connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0 || errno != ECONNREFUSED){
+            unix_error(path);
+        }
+        close(probe);
+        unlink(path);
+        if(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+            unix_error(path);
+        }
+    }
+    if(listen(lfd, SOMAXCONN) < 0){
+        unix_error("listen error");
     }
 
-    fclose(fp);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGCHLD);      /* a session ended */
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGHUP);
+    if(sigprocmask(SIG_BLOCK, &sigs, &old) < 0){
+        unix_error("sigprocmask error");
+    }
+    if((sfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0){
+        unix_error("signalfd error");
+    }
+    if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        unix_error("epoll_create1 error");
+    }
+    ev.data.fd = lfd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) < 0){
+        unix_error("epoll_ctl error");
+    }
+    ev.data.fd = sfd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) < 0){
+        unix_error("epoll_ctl error");
+    }
+
+    passwd_open();
+    load_path();
+    printf("tsh: serving sessions on %s\n", path);
+    fflush(stdout);     // or every session would print it again
+
+    while(1){
+        if((n = epoll_wait(epfd, evs, 2, -1)) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        for(int i = 0; i < n; i++){
+            if(evs[i].data.fd == sfd){
+                ssize_t got;
+                while((got = read(sfd, si, sizeof(si))) > 0){
+                    for(int k = 0; k < got / (ssize_t)sizeof(si[0]); k++){
+                        if(si[k].ssi_signo != SIGCHLD){
+                            unlink(path);   // the sessions go on until they log out
+                            exit(0);
+                        }
+                    }
+                }
+                while(waitpid(-1, NULL, WNOHANG) > 0)
+                    ;
+                continue;
+            }
 
-    for(int j = i; j < MAXHISTORY; j++){
-        history[j][0] = '\0';
+            while((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0){
+                passwd_open();  // the sessions inherit an index that is current
+                if((pid = fork()) < 0){
+                    printf("fork error: %s\n", strerror(errno));
+                    fflush(stdout);
+                    close(cfd);
+                    continue;
+                }
+                if(pid == 0){
+                    close(lfd);
+                    close(sfd);
+                    close(epfd);
+                    dup2(cfd, STDIN_FILENO);
+                    dup2(cfd, STDOUT_FILENO);
+                    dup2(cfd, STDERR_FILENO);
+                    close(cfd);
+                    setsid();
+                    if(sigprocmask(SIG_SETMASK, &old, NULL) < 0){
+                        unix_error("sigprocmask error");
+                    }
+                    return;
+                }
+                close(cfd);
+            }
+            if(errno != EAGAIN && errno != EINTR && errno != ECONNABORTED){
+                unix_error("accept error");
+            }
+        }
     }
+}
+
+/*
+ * run_batch - Evaluate each line of buf, the text of a script or of
+ *    the -c argument. Lines whose first non-blank is '#' are comments.
+ */
+void run_batch(const char *buf, size_t len){
+    const char *end = buf + len;
 
-    history_idx = i % MAXHISTORY;
+    while(buf < end){
+        const char * nl = memchr(buf, '\n', end - buf);
+        size_t n = (nl != NULL ? nl : end) - buf;
+        const char * c = buf;
+
+        while(c < buf + n && (*c == ' ' || *c == '\t')){
+            c++;
+        }
+        if(c < buf + n && *c != '#'){
+            struct arena_mark_t mark = arena_mark();
+            dispatch_signals();         // reap what finished in the background
+            char * cmdline = arena_alloc(n + 2);
+            memcpy(cmdline, buf, n);    // eval wants "...\n\0", as getline gives
+            cmdline[n] = '\n';
+            cmdline[n + 1] = '\0';
+            eval(cmdline);
+            flush_procs();
+            arena_release(mark);
+        }
+        buf += n + 1;
+    }
 }
 
+/*
+ * Users are looked up in ./etc/passwd.cdb, an index of ./etc/passwd in
+ * the cdb format: a header of 256 (position, length) pairs, the
+ * records (key length, data length, key, data), then 256 open hash
+ * tables of (hash, record position), all little-endian 32-bit. A name
+ * is found with one hash and, almost always, one probe. The key is the
+ * name and the data the rest of the line. The index also holds, under
+ * a key no name can be ("\0"), the identity of the passwd it was built
+ * from; whoever finds passwd changed builds a new index and renames it
+ * into place, so readers never see one half written.
+ */
 
-// if name exists in file passwd, set variable password to be the corresponding password
-int exist_user(char * name, char password[]){ 
-    char line[MAXLINE*2];
-    char * line_name, * line_password;
+/* cdb_hash - The cdb hash of the len bytes at s */
+static inline uint32_t cdb_hash(const char *s, size_t len){
+    uint32_t h = 5381;
 
-    FILE * fp = fopen("./etc/passwd", "r");
-    if(fp == NULL){
-        unix_error("fopen");
+    for(size_t k = 0; k < len; k++){
+        h = ((h << 5) + h) ^ (unsigned char)s[k];
     }
+    return h;
+}
 
-    while(fgets(line, MAXLINE*2, fp)!=NULL){
-        line_name = strtok(line, ":");
-        if(strcmp(name, line_name) == 0){
-            line_password = strtok(NULL, ":");
-            strcpy(password, line_password); 
-            fclose(fp);
+/* cdb_u32 - The little-endian number at p */
+static inline uint32_t cdb_u32(const char *p){
+    const unsigned char *u = (const unsigned char *)p;
+    return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+/* cdb_put32 - Store n at p, little-endian */
+static inline void cdb_put32(char *p, uint32_t n){
+    p[0] = n;
+    p[1] = n >> 8;
+    p[2] = n >> 16;
+    p[3] = n >> 24;
+}
+
+/* cdb_find - Look key up in the mapped cdb; set *data and *dlen. Returns 0 if it is not there */
+int cdb_find(const char *map, size_t size, const char *key, size_t klen, const char **data, uint32_t *dlen){
+    uint32_t h = cdb_hash(key, klen);
+
+    if(size < CDB_HEADER){
+        return 0;
+    }
+    uint32_t tpos = cdb_u32(map + (h & 255) * 8), tlen = cdb_u32(map + (h & 255) * 8 + 4);
+    if(tlen == 0 || tpos > size || tlen > (size - tpos) / 8){
+        return 0;
+    }
+    for(uint32_t n = 0, slot = (h >> 8) % tlen; n < tlen; n++, slot = (slot + 1) % tlen){
+        uint32_t sh = cdb_u32(map + tpos + slot * 8), pos = cdb_u32(map + tpos + slot * 8 + 4);
+        if(pos == 0){
+            return 0;
+        }
+        if(sh != h || pos > size - 8){
+            continue;
+        }
+        uint32_t kl = cdb_u32(map + pos), dl = cdb_u32(map + pos + 4);
+        if(kl == klen && (size_t)kl + dl <= size - pos - 8 && memcmp(map + pos + 8, key, klen) == 0){
+            *data = map + pos + 8 + kl;
+            *dlen = dl;
             return 1;
         }
     }
-
-    fclose(fp);
     return 0;
 }
 
+/* passwd_stamp - What identifies a version of passwd */
+void passwd_stamp(struct stat *st, struct pwstamp_t *stamp){
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->dev = st->st_dev;
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->sec = st->st_mtim.tv_sec;
+    stamp->nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * passwd_build - Write the index of the passwd open on fd, which st
+ *    describes, to a file of our own and rename it over PASSWD_DB.
+ */
+void passwd_build(int fd, struct stat *st){
+    struct pwstamp_t stamp;
+    size_t nrec = 1, at, i;
+    char tmp[MAXLINE];
+    ssize_t n;
+
+    char * src = malloc(st->st_size + 1);
+    if(src == NULL){
+        unix_error("malloc error");
+    }
+    for(at = 0; at < (size_t)st->st_size; at += n){    // what the stamp describes, no more
+        if((n = pread(fd, src + at, st->st_size - at, at)) <= 0){
+            break;
+        }
+    }
+    for(i = 0; i < at; i++){
+        nrec += src[i] == '\n';
+    }
+    nrec++;     // a last line without '\n'
+
+    // records: the stamp, then every "name:rest" line
+    struct cdbrec_t { uint32_t hash, pos; } * recs = malloc(nrec * sizeof(struct cdbrec_t));
+    char * out = malloc(CDB_HEADER + at + nrec * (8 + 16) + sizeof(stamp) + 16);
+    if(recs == NULL || out == NULL){
+        unix_error("malloc error");
+    }
+    size_t len = CDB_HEADER, r = 0;
+    passwd_stamp(st, &stamp);
+    recs[r].hash = cdb_hash("", 1);
+    recs[r++].pos = len;
+    cdb_put32(out + len, 1);
+    cdb_put32(out + len + 4, sizeof(stamp));
+    out[len + 8] = '\0';
+    memcpy(out + len + 9, &stamp, sizeof(stamp));
+    len += 9 + sizeof(stamp);
+    for(char * line = src, * end; line < src + at; line = end + 1){
+        if((end = memchr(line, '\n', src + at - line)) == NULL){
+            end = src + at;
+        }
+        char * colon = memchr(line, ':', end - line);
+        if(colon == NULL || colon == line){
+            continue;
+        }
+        recs[r].hash = cdb_hash(line, colon - line);
+        recs[r++].pos = len;
+        cdb_put32(out + len, colon - line);
+        cdb_put32(out + len + 4, end - colon - 1);
+        memcpy(out + len + 8, line, colon - line);
+        memcpy(out + len + 8 + (colon - line), colon + 1, end - colon - 1);
+        len += 8 + (end - line) - 1;
+    }
+    free(src);
+
+    // the tables: twice as many slots as records, filled in record order
+    uint32_t count[256] = { 0 }, start[256];
+    for(i = 0; i < r; i++){
+        count[recs[i].hash & 255]++;
+    }
+    if((out = realloc(out, len + r * 2 * 8)) == NULL){
+        unix_error("realloc error");
+    }
+    memset(out + len, 0, r * 2 * 8);
+    for(int t = 0; t < 256; t++){
+        start[t] = len;
+        cdb_put32(out + t * 8, len);
+        cdb_put32(out + t * 8 + 4, count[t] * 2);
+        len += count[t] * 2 * 8;
+    }
+    for(i = 0; i < r; i++){
+        uint32_t t = recs[i].hash & 255, tlen = count[t] * 2;
+        uint32_t slot = (recs[i].hash >> 8) % tlen;
+        while(cdb_u32(out + start[t] + slot * 8 + 4) != 0){
+            slot = (slot + 1) % tlen;
+        }
+        cdb_put32(out + start[t] + slot * 8, recs[i].hash);
+        cdb_put32(out + start[t] + slot * 8 + 4, recs[i].pos);
+    }
+    free(recs);
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", PASSWD_DB, getpid());
+    int dbfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(dbfd < 0){
+        unix_error(tmp);
+    }
+    for(at = 0; at < len; at += n){
+        if((n = write(dbfd, out + at, len - at)) < 0){
+            unix_error("write error");
+        }
+    }
+    free(out);
+    if(close(dbfd) < 0 || rename(tmp, PASSWD_DB) < 0){
+        unix_error("rename error");
+    }
+}
+
+/*
+ * passwd_open - Make sure pwdb maps an index of passwd as it is now:
+ *    the one mapped already, the one on disk, or a new one. Costs a
+ *    stat when nothing changed.
+ */
+void passwd_open(){
+    struct pwstamp_t stamp;
+    struct stat st;
+    const char * data;
+    uint32_t dlen;
+
+    int fd = open(PASSWD_PATH, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) < 0){
+        unix_error(PASSWD_PATH);
+    }
+    passwd_stamp(&st, &stamp);
+    if(pwdb.map != NULL && memcmp(&pwdb.stamp, &stamp, sizeof(stamp)) == 0){
+        close(fd);
+        return;
+    }
+
+    for(int tries = 0; tries < 2; tries++){
+        if(pwdb.map != NULL){
+            munmap(pwdb.map, pwdb.size);
+            pwdb.map = NULL;
+        }
+        struct stat dbst;
+        int dbfd = open(PASSWD_DB, O_RDONLY | O_CLOEXEC);
+        if(dbfd >= 0 && fstat(dbfd, &dbst) == 0 && dbst.st_size >= CDB_HEADER){
+            pwdb.size = dbst.st_size;
+            pwdb.map = mmap(NULL, pwdb.size, PROT_READ, MAP_SHARED, dbfd, 0);
+            if(pwdb.map == MAP_FAILED){
+                pwdb.map = NULL;
+            }
+        }
+        if(dbfd >= 0){
+            close(dbfd);
+        }
+        if(pwdb.map != NULL && cdb_find(pwdb.map, pwdb.size, "", 1, &data, &dlen) &&
+           dlen == sizeof(stamp) && memcmp(data, &stamp, sizeof(stamp)) == 0){
+            pwdb.stamp = stamp;
+            close(fd);
+            return;
+        }
+        passwd_build(fd, &st);
+    }
+    app_error("cannot index " PASSWD_PATH);
+}
+
+// if name exists in file passwd, set variable password to be the corresponding password
+int exist_user(char * name, char password[]){ 
+    const char * data;
+    uint32_t dlen;
+
+    passwd_open();
+    if(!cdb_find(pwdb.map, pwdb.size, name, strlen(name), &data, &dlen)){
+        return 0;
+    }
+    const char * colon = memchr(data, ':', dlen);
+    size_t len = colon != NULL ? (size_t)(colon - data) : dlen;
+    if(len > MAXLINE - 1){
+        len = MAXLINE - 1;
+    }
+    memcpy(password, data, len);
+    password[len] = '\0';
+    return 1;
+}
+
 int check_auth(char * name, char * passwd){
     char line_password[MAXLINE];
     if(exist_user(name, line_password)){
@@ -249,6 +1166,64 @@ int check_auth(char * name, char * passwd){
     return 0;
 }
 
+/*
+ * auth_login - Log in without prompting, for scripts that start many
+ *    shells: with the token "user:password" read from descriptor fd
+ *    (tsh -a fd), or else taken from TSH_AUTH. The token is checked
+ *    against the passwd index like the prompts are, but a wrong one
+ *    ends the shell, as there is no one to try again. TSH_AUTH is
+ *    removed from the environment so commands never see it. Falls
+ *    back to login when there is no token.
+ */
+char * auth_login(int fd){
+    char token[2 * MAXLINE];
+    size_t len = 0;
+    ssize_t n;
+
+    if(fd >= 0){
+        while(len < sizeof(token) - 1 && memchr(token, '\n', len) == NULL){
+            if((n = read(fd, token + len, sizeof(token) - 1 - len)) < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                unix_error("auth token read error");
+            }
+            if(n == 0){
+                break;
+            }
+            len += n;
+        }
+        close(fd);
+    }else{
+        char * env = getenv("TSH_AUTH");
+        if(env == NULL){
+            return login();
+        }
+        len = strlen(env);
+        if(len > sizeof(token) - 1){
+            len = sizeof(token) - 1;
+        }
+        memcpy(token, env, len);
+        explicit_bzero(env, strlen(env));
+        unsetenv("TSH_AUTH");
+    }
+    token[len] = '\0';
+    token[strcspn(token, "\r\n")] = '\0';
+
+    char * colon = strchr(token, ':');
+    int ok = colon != NULL && (*colon = '\0', check_auth(token, colon + 1));
+    char * name = ok ? strdup(token) : NULL;
+    explicit_bzero(token, sizeof(token));
+    if(!ok){
+        printf("User Authentication failed.\n");
+        exit(1);
+    }
+    if(name == NULL){
+        unix_error("strdup error");
+    }
+    return name;
+}
+
 /*
  * login - Performs user authentication for the shell
  *
@@ -257,14 +1232,17 @@ int check_auth(char * name, char * passwd){
  * This function returns a string of the username that is logged in
  */
 char * login() {
-    char * name = (char*) malloc (sizeof(char) * MAXLINE);
-    char passwd[MAXLINE];
+    char * name = NULL, * passwd = NULL;
+    size_t namecap = 0, passwdcap = 0;
 
     while(1){
         printf("username: ");
         fflush(stdout);
-        fgets(name, MAXLINE, stdin);    // use fgets, instead of scanf, in case there are spaces in the input
-        name[strlen(name) - 1] = '\0';  // deal with '\n' at the end
+        // read_line, not stdio: the command lines after these come from the same buffer
+        if(read_line(&name, &namecap) < 0){
+            exit(0);
+        }
+        name[strcspn(name, "\n")] = '\0';  // deal with '\n' at the end
         if(strcmp(name, "quit") == 0){
             free(name);
             exit(0);
@@ -272,14 +1250,17 @@ char * login() {
 
         printf("password: ");
         fflush(stdout);
-        fgets(passwd, MAXLINE, stdin); 
-        passwd[strlen(passwd) - 1] = '\0';
+        if(read_line(&passwd, &passwdcap) < 0){
+            exit(0);
+        }
+        passwd[strcspn(passwd, "\n")] = '\0';
         if(strcmp(passwd, "quit") == 0){
             free(name);
             exit(0);
         }
 
         if(check_auth(name, passwd)){
+            free(passwd);
             return name;
         }else{
             printf("User Authentication failed. Please try again.\n");
@@ -288,372 +1269,3264 @@ char * login() {
 
 }
 
-int history_start(){
-    int start = history_idx;
-    if(history[start][0] == '\0'){
-        start = 0;
-    }
-    return start;
+/*
+ * History is a log, ./home/<user>/.tsh_history, one command per line.
+ * Every command is appended to it as it is run, with one write on an
+ * O_APPEND descriptor, so nothing is lost if the shell dies. The shell
+ * maps the log rather than reading it, and indexes it lazily from the
+ * end: histlog.off[lo..n) are the offsets of the last n-lo commands,
+ * and older ones are indexed by history_scan only when a command asks
+ * for them, so logging in costs the same whatever the size of the log.
+ * The history shows the last histlog.size commands (tsh -H). The log
+ * is allowed to grow to twice that before compact_history cuts it
+ * back, when the shell is idle, by writing the commands kept to a new
+ * file and renaming it over the log. Every shell of a user appends to
+ * the same log, and history_sync indexes the commands of the others as
+ * it finds them; inotify on the home directory wakes it for that.
+ */
+
+/* history_dir - The home directory of the logged in user */
+void history_dir(char *path, size_t size){
+    snprintf(path, size, "./home/%s", username);
 }
 
-void add_history(char * cmdline){
-    strcpy(history[history_idx], cmdline);
-    history_idx = (history_idx + 1) % MAXHISTORY;
+/* history_path - Where the log of the logged in user is */
+void history_path(char *path, size_t size){
+    snprintf(path, size, "./home/%s/.tsh_history", username);
 }
 
-void save_history(){    // save to file
+/*
+ * history_map - Open and map the log. The mapping is made larger than
+ *    the file, so that the commands appended after it are in it too.
+ */
+void history_map(){
     char path[MAXLINE];
-    sprintf(path, "./home/%s/.tsh_history", username);
-
-    int start = history_start();
+    struct stat st;
 
-    FILE * fp = fopen(path, "w");
-    if(fp == NULL){
-        unix_error("fopen");
+    history_path(path, sizeof(path));
+    if((histlog.fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC)) < 0 || fstat(histlog.fd, &st) < 0){
+        unix_error(path);
     }
-
-    for(int count = 0; count < MAXHISTORY && history[start][0] != '\0'; count++){
-        fprintf(fp, "%s", history[start]);
-        start = (start + 1) % MAXHISTORY;
+    histlog.len = histlog.start = st.st_size;
+    histlog.maplen = (st.st_size * 2 / HIST_MAPMIN + 1) * HIST_MAPMIN;
+    histlog.text = mmap(NULL, histlog.maplen, PROT_READ, MAP_SHARED, histlog.fd, 0);
+    if(histlog.text == MAP_FAILED){
+        unix_error("mmap error");
     }
-
-    fclose(fp);
 }
 
-void list_history(){
-    int start = history_start();
-    for(int count = 0; count < MAXHISTORY && history[start][0] != '\0'; count++){
-        printf("%d %s", count + 1, history[start]);
-        start = (start + 1) % MAXHISTORY; 
-    }
-} 
+/* history_room - Make room for one more offset at the end (at == 1) or the front (at == 0) */
+void history_room(int at){
+    size_t cnt = histlog.n - histlog.lo;
 
-char * nth_history(int n){
-    int start = history_start();
-    start = (start + n - 1) % MAXHISTORY;
-    return history[start];
+    if(at ? histlog.n < histlog.offcap : histlog.lo > 0){
+        return;
+    }
+    size_t cap = histlog.offcap ? histlog.offcap * 2 : 1024;
+    size_t * off = malloc(cap * sizeof(size_t));
+    if(off == NULL){
+        unix_error("malloc error");
+    }
+    size_t lo = (cap - cnt) / 2;    // room on both sides
+    if(cnt > 0){
+        memcpy(off + lo, histlog.off + histlog.lo, cnt * sizeof(size_t));
+    }
+    free(histlog.off);
+    histlog.off = off;
+    histlog.offcap = cap;
+    histlog.idbase -= (long)lo - (long)histlog.lo;
+    histlog.lo = lo;
+    histlog.n = lo + cnt;
 }
 
-/* 
- * eval - Evaluate the command line that the user has just typed in
- * 
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.  
-*/
-void eval(char *cmdline) 
-{
-    char *argv[MAXARGS];
-    int bg;
-    pid_t pid;
+/*
+ * A command already in the log is not written again: add_history
+ * writes a reference instead, a NUL (which no command line holds) and
+ * the offset of the earlier copy, when that is shorter. The log is
+ * then plain text with references, and an old plain log is read as it
+ * is. To find the earlier copy, the shell interns every command it
+ * indexes: interns maps the text to where it is in the log, and keeps
+ * offsets into the mapping rather than copies. compact_history writes
+ * the log out again with references for every repeat.
+ */
 
-    bg = parseline(cmdline, argv);
-    if(argv[0] == NULL){
-        return;
+/* text_hash - Hash of the len bytes at s */
+static inline uint64_t text_hash(const char *s, size_t len){
+    uint64_t h = 0;
+
+    for(size_t k = 0; k < len; k++){
+        h = h * 31 + (unsigned char)s[k];
     }
+    return h;
+}
 
-    if(argv[0][0] != '!')
-        add_history(cmdline);
+/* intern_slot - The entry of t for the len bytes at s, or the free one they would take */
+struct intern_t *intern_slot(struct interns_t *t, const char *s, size_t len, uint64_t h){
+    size_t mask = t->cap - 1, i;
 
-    if(!builtin_cmd(argv)){
-        sigset_t mask_all, prev;
-        sigfillset(&mask_all);
-        sigprocmask(SIG_BLOCK, &mask_all, &prev);   // block all signals
+    for(i = h & mask; t->slots[i].text != 0; i = (i + 1) & mask){
+        if(t->slots[i].hash == h && t->slots[i].len == len &&
+           memcmp(histlog.text + t->slots[i].text - 1, s, len) == 0){
+            break;
+        }
+    }
+    return &t->slots[i];
+}
 
-        if((pid = fork()) ==0){
-            sigprocmask(SIG_SETMASK, &prev, NULL);   //unblock
-            setpgid(0, 0);                          // put child in a new process group
-            if(execve(argv[0], argv, environ) < 0){
-                printf("%s: Command not found.\n", argv[0]);
-                exit(1);
+/* intern_get - Where the log has the len bytes at s, + 1; 0 if t does not know */
+size_t intern_get(struct interns_t *t, const char *s, size_t len){
+    if(t->n == 0){
+        return 0;
+    }
+    struct intern_t * e = intern_slot(t, s, len, text_hash(s, len));
+    return e->text != 0 ? e->off + 1 : 0;
+}
+
+/*
+ * intern - Record that the len bytes at s, in the mapped log, are to
+ *    be referred to at off, unless t has them already. Returns where
+ *    they were, + 1, or 0 if they are new.
+ */
+size_t intern(struct interns_t *t, const char *s, size_t len, size_t off){
+    uint64_t h = text_hash(s, len);
+
+    if((t->n + 1) * 2 > t->cap){    // at most half full
+        struct intern_t *old = t->slots;
+        size_t oldcap = t->cap;
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        if((t->slots = calloc(t->cap, sizeof(struct intern_t))) == NULL){
+            unix_error("calloc error");
+        }
+        for(size_t i = 0; i < oldcap; i++){
+            if(old[i].text != 0){
+                *intern_slot(t, histlog.text + old[i].text - 1, old[i].len, old[i].hash) = old[i];
             }
         }
+        free(old);
+    }
+    struct intern_t * e = intern_slot(t, s, len, h);
+    if(e->text != 0){
+        return e->off + 1;
+    }
+    e->hash = h;
+    e->text = s - histlog.text + 1;
+    e->len = len;
+    e->off = off;
+    t->n++;
+    return 0;
+}
 
-        int state;
-        char stat[3];
-        if(!bg){
-            state = FG;
-            strcpy(stat, "R+");
-            change_proc_stat(shell_pid, "Ss");
-        }else{
-            state = BG;
-            strcpy(stat, "R");
-        }
-        addjob(jobs, pid, state, cmdline);
+/* intern_reset - Forget every text in t */
+void intern_reset(struct interns_t *t){
+    free(t->slots);
+    t->slots = NULL;
+    t->cap = t->n = 0;
+}
 
-        add_proc(argv[0], pid, shell_pid, stat);
+/*
+ * history_text - The command of the line at off in the log, and its
+ *    length (without '\n'), following a reference. A reference that
+ *    does not lead to a command has length 0, and points at itself so
+ *    the result is always in the map.
+ */
+char * history_text(size_t off, size_t *len){
+    char * s = histlog.text + off, * nl;
+
+    if(*s == '\0'){
+        size_t to = strtoull(s + 1, NULL, 10);
+        if(to >= histlog.len || (to > 0 && histlog.text[to - 1] != '\n') || histlog.text[to] == '\0'){
+            *len = 0;
+            return s;
+        }
+        s = histlog.text + to;
+    }
+    nl = memchr(s, '\n', histlog.text + histlog.len - s);
+    *len = nl != NULL ? (size_t)(nl - s) : 0;
+    return s;
+}
 
-        sigprocmask(SIG_SETMASK, &prev, NULL);  // unblock
+/* history_intern - Intern the line at off in the log if it is a command, not a reference */
+void history_intern(size_t off){
+    size_t len;
 
-        if(!bg){
-            waitfg(pid); 
-            change_proc_stat(shell_pid, "Rs+");
-        }
+    if(histlog.text[off] != '\0'){
+        char * s = history_text(off, &len);
+        intern(&interns, s, len, off);
+    }
+}
 
+/*
+ * history_scan - Index older commands, going back from histlog.start,
+ *    until want are indexed or the start of the log is reached.
+ */
+void history_scan(size_t want){
+    while(histlog.n - histlog.lo < want && histlog.start > 0){
+        // the '\n' at start-1 ends the previous command; the one before it starts it
+        char * nl = histlog.start > 1 ? memrchr(histlog.text, '\n', histlog.start - 1) : NULL;
+        history_room(0);
+        histlog.start = nl != NULL ? (size_t)(nl + 1 - histlog.text) : 0;
+        histlog.off[--histlog.lo] = histlog.start;
+        history_intern(histlog.start);
     }
-    return;
 }
 
+/* init_history - Map the log of the user that has logged in, and watch it for other shells' commands */
+void init_history(){  
+    char dir[MAXLINE];
+    struct epoll_event ev = { .events = EPOLLIN };
 
+    history_map();
+    if(histlog.len > 0 && histlog.text[histlog.len - 1] != '\n'){
+        if(write(histlog.fd, "\n", 1) == 1){  // end a line cut off by a crash
+            histlog.start = ++histlog.len;
+        }
+    }
+
+    history_dir(dir, sizeof(dir));
+    if(inepfd < 0 || (histlog.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0){
+        return;     // history_count still catches up, when it is asked
+    }
+    ev.data.fd = histlog.ifd;
+    if(inotify_add_watch(histlog.ifd, dir, IN_MODIFY | IN_MOVED_TO) < 0 ||
+       epoll_ctl(inepfd, EPOLL_CTL_ADD, histlog.ifd, &ev) < 0){
+        close(histlog.ifd);
+        histlog.ifd = -1;
+    }
+}
+
+/* history_reopen - Another shell has compacted the log: start over on the new one */
+void history_reopen(){
+    close(histlog.fd);
+    munmap(histlog.text, histlog.maplen);
+    history_map();
+    histlog.lo = histlog.n;     // nothing indexed; history_scan starts from the end again
+    trigram_reset();
+    intern_reset(&interns);
+}
+
+/*
+ * history_sync - Index the commands appended to the log since it was
+ *    last looked at, by this shell or any other. Only whole lines are
+ *    taken: a write on O_APPEND is never seen in part.
+ */
+void history_sync(){
+    struct stat st;
+    char * p, * nl;
+
+    if(fstat(histlog.fd, &st) < 0){
+        unix_error("fstat error");
+    }
+    if(st.st_nlink == 0){       // renamed over by a compaction
+        history_reopen();
+        return;
+    }
+    if((size_t)st.st_size <= histlog.len){
+        return;
+    }
+    history_cover(st.st_size);
+
+    for(p = histlog.text + histlog.len; (nl = memchr(p, '\n', histlog.text + st.st_size - p)) != NULL; p = nl + 1){
+        history_room(1);
+        histlog.off[histlog.n++] = p - histlog.text;
+        histlog.len = nl + 1 - histlog.text;
+        history_intern(p - histlog.text);
+        if(trigram_built){
+            trigram_add(histlog.n - 1);
+        }
+    }
+}
+
+/* history_cover - Make the mapping of the log reach size bytes */
+void history_cover(size_t size){
+    size_t maplen = histlog.maplen;
+
+    if(size <= maplen){
+        return;
+    }
+    while(maplen < size){
+        maplen *= 2;
+    }
+    char * text = mremap(histlog.text, histlog.maplen, maplen, MREMAP_MAYMOVE);
+    if(text == MAP_FAILED){
+        unix_error("mremap error");
+    }
+    histlog.text = text;
+    histlog.maplen = maplen;
+}
+
+/* history_events - Catch up with what other shells did to the log, while waiting for input */
+void history_events(){
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while(read(histlog.ifd, buf, sizeof(buf)) > 0)
+        ;   // which file does not matter: history_sync looks at the log anyway
+    history_sync();
+}
+
+/*
+ * add_history - Append cmdline to the log and index it, with those
+ *    other shells appended before it. If a compaction replaced the log
+ *    under us, the write went to the old file: it is made again.
+ */
+void add_history(char * cmdline){
+    size_t len = strcspn(cmdline, "\n"), at;
+    char ref[32] = "";
+    struct stat st;
+
+    for(int tries = 0; tries < 2; tries++){
+        struct iovec iov[2] = { { cmdline, len }, { "\n", 1 } };
+        size_t n = len + 1;
+        if((at = intern_get(&interns, cmdline, len)) != 0 &&
+           (n = snprintf(ref + 1, sizeof(ref) - 1, "%zu\n", at - 1) + 1) < len + 1){
+            iov[0].iov_base = ref;  // "\0<offset>\n"
+            iov[0].iov_len = n;
+            iov[1].iov_len = 0;
+        }else{
+            n = len + 1;
+        }
+        if(writev(histlog.fd, iov, 2) != (ssize_t)n){
+            printf("history: %s\n", strerror(errno));
+            return;
+        }
+        if(fstat(histlog.fd, &st) == 0 && st.st_nlink > 0){
+            break;
+        }
+        history_reopen();
+    }
+    history_sync();
+}
+
+/* history_count - How many commands the history shows */
+size_t history_count(){
+    if(histlog.ifd < 0){    // nothing tells us of other shells' commands
+        history_sync();
+    }
+    history_scan(histlog.size);
+    return histlog.n - histlog.lo < histlog.size ? histlog.n - histlog.lo : histlog.size;
+}
+
+/* nth_history - Return the nth command of the list and its length (without '\n'), NULL if there is none */
+char * nth_history(size_t n, size_t *len){
+    size_t count = history_count();
+
+    if(n < 1 || n > count){
+        return NULL;
+    }
+    return history_entry(histlog.n - count + n - 1, len);
+}
+
+void list_history(){
+    size_t len, count = history_count();
+    for(size_t n = 1; n <= count; n++){
+        char * cmd = nth_history(n, &len);
+        printf("%zu %.*s\n", n, (int)len, cmd);
+    }
+} 
+
+/*
+ * compact_history - Once twice the commands the history shows have
+ *    been indexed, or if force, rewrite the log with only those, each
+ *    command in full once and as a reference after that. Called when the shell is
+ *    idle; the new log is complete before it replaces the old. Only
+ *    one shell compacts at a time (a flock on the home directory, the
+ *    one lock taken on the log), and the others go on appending
+ *    meanwhile: what reached the old log after it was copied is copied
+ *    after the rename, and a shell that appends to the old log after
+ *    that sees it unlinked and appends again (see add_history). A
+ *    command can at worst be in the new log twice, and is never lost.
+ */
+void compact_history(int force){
+    char dir[MAXLINE], path[MAXLINE], tmp[MAXLINE + 32];
+    struct interns_t seen = { 0 };  // the commands written, at their new offsets
+    struct stat st;
+    size_t len, at = 0;
+
+    if(histlog.fd < 0 || (!force && histlog.n - histlog.lo <= 2 * histlog.size)){
+        return;
+    }
+    history_dir(dir, sizeof(dir));
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirfd < 0 || flock(dirfd, LOCK_EX | LOCK_NB) < 0){
+        if(dirfd >= 0){
+            close(dirfd);   // another shell is at it
+        }
+        return;
+    }
+    history_sync();
+    size_t keep = history_count();
+    if(!force && histlog.n - histlog.lo <= 2 * histlog.size){     // it was just done
+        close(dirfd);
+        return;
+    }
+
+    history_path(path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    FILE * fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if(fp == NULL){
+        unix_error(tmp);
+    }
+    for(size_t i = histlog.n - keep; i < histlog.n; i++){
+        char * s = history_entry(i, &len), ref[32];
+        if(len == 0){
+            continue;   // a broken reference: there is no command to keep
+        }
+        size_t prev = intern(&seen, s, len, at), n;
+        if(prev != 0 && (n = snprintf(ref, sizeof(ref), "%zu\n", prev - 1) + 1) < len + 1){
+            putc('\0', fp);
+            fputs(ref, fp);
+            at += n;
+        }else{
+            fwrite(s, 1, len, fp);
+            putc('\n', fp);
+            at += len + 1;
+        }
+    }
+    intern_reset(&seen);
+    if(fclose(fp) != 0 || rename(tmp, path) < 0){
+        unix_error("rename error");
+    }
+
+    // copy what reached the old log meanwhile, in full: its references are to the old one
+    if(fstat(histlog.fd, &st) < 0){
+        unix_error("fstat error");
+    }
+    size_t from = histlog.len;
+    history_cover(st.st_size);
+    histlog.len = st.st_size;   // so history_text follows references into the new lines
+    fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    for(char * p = histlog.text + from, * nl;
+        fd >= 0 && (nl = memchr(p, '\n', histlog.text + st.st_size - p)) != NULL; p = nl + 1){
+        char * s = history_text(p - histlog.text, &len);
+        if(len == 0){
+            continue;
+        }
+        struct iovec iov[2] = { { s, len }, { "\n", 1 } };
+        if(writev(fd, iov, 2) < 0){
+            break;
+        }
+    }
+    if(fd >= 0){
+        close(fd);
+    }
+
+    history_reopen();   // the new log is indexed again from its end, as needed
+    close(dirfd);       // and the lock with it
+}
+
+/* history_entry - The command at off[i] and its length (without '\n') */
+char * history_entry(size_t i, size_t *len){
+    return history_text(histlog.off[i], len);
+}
+
+/*
+ * Substring search goes through a trigram index: for every three bytes
+ * that occur in a command, the ids of the commands they occur in, in
+ * ascending order. A command has the id i + histlog.idbase, which does
+ * not change as off[] is moved around. The index is built the first
+ * time it is needed and then kept up to date by add_history; a
+ * compaction drops it. A pattern's candidates are the ids common to
+ * the lists of all its trigrams, and are checked with memmem. Under
+ * keys of their own (prefix_key), the index also lists the commands
+ * starting with each of their first 1, 2 and 3 bytes, for !prefix.
+ */
+
+/* trigram_get - The entry of key in the index; made if create, else NULL if none */
+struct trigram_t *trigram_get(uint32_t key, int create){
+    uint32_t mask = trigramcap - 1, i;
+
+    if(trigramcap > 0){
+        for(i = (key * 2654435761u) & mask; trigrams[i].key != 0; i = (i + 1) & mask){
+            if(trigrams[i].key == key){
+                return &trigrams[i];
+            }
+        }
+    }
+    if(!create){
+        return NULL;
+    }
+    if((ntrigrams + 1) * 2 > trigramcap){  // at most half full
+        struct trigram_t *old = trigrams;
+        uint32_t oldcap = trigramcap;
+        trigramcap = trigramcap ? trigramcap * 2 : 4096;
+        if((trigrams = calloc(trigramcap, sizeof(struct trigram_t))) == NULL){
+            unix_error("calloc error");
+        }
+        mask = trigramcap - 1;
+        for(uint32_t j = 0; j < oldcap; j++){
+            if(old[j].key != 0){
+                for(i = (old[j].key * 2654435761u) & mask; trigrams[i].key != 0; i = (i + 1) & mask)
+                    ;
+                trigrams[i] = old[j];
+            }
+        }
+        free(old);
+    }
+    for(i = (key * 2654435761u) & mask; trigrams[i].key != 0; i = (i + 1) & mask)
+        ;
+    trigrams[i].key = key;
+    ntrigrams++;
+    return &trigrams[i];
+}
+
+/* trigram_key - The index key of the three bytes at s */
+static inline uint32_t trigram_key(const char *s){
+    return ((unsigned char)s[0] << 16 | (unsigned char)s[1] << 8 | (unsigned char)s[2]) + 1;
+}
+
+/*
+ * prefix_key - The index key of commands starting with the n (1 to 3)
+ *    bytes at s, for !prefix. These keys are above those of trigrams.
+ */
+static inline uint32_t prefix_key(const char *s, size_t n){
+    uint32_t key = 0;
+
+    for(size_t k = 0; k < 3; k++){
+        key = key << 8 | (k < n ? (unsigned char)s[k] : 0);
+    }
+    return 1u << 26 | n << 24 | key;
+}
+
+/* trigram_post - Add id to the list of key, unless it is the last one there */
+void trigram_post(uint32_t key, uint32_t id){
+    struct trigram_t * t = trigram_get(key, 1);
+
+    if(t->n > 0 && t->ids[t->n - 1] == id){
+        return;
+    }
+    if(t->n == t->cap){
+        t->cap = t->cap ? t->cap * 2 : 4;
+        if((t->ids = realloc(t->ids, t->cap * sizeof(uint32_t))) == NULL){
+            unix_error("realloc error");
+        }
+    }
+    t->ids[t->n++] = id;
+}
+
+/* trigram_add - Index the command at off[i] */
+void trigram_add(size_t i){
+    uint32_t id = i + histlog.idbase;
+    size_t len;
+    char * s = history_entry(i, &len);
+
+    for(size_t k = 0; k + 3 <= len; k++){
+        trigram_post(trigram_key(s + k), id);
+    }
+    for(size_t n = 1; n <= 3 && n <= len; n++){
+        trigram_post(prefix_key(s, n), id);
+    }
+}
+
+/* trigram_build - Index the history, if that is not done yet */
+void trigram_build(){
+    size_t first = histlog.n - history_count();
+
+    if(trigram_built){
+        return;
+    }
+    histlog.idbase = -(long)first;  // ids from 0
+    for(size_t i = first; i < histlog.n; i++){
+        trigram_add(i);
+    }
+    trigram_built = 1;
+}
+
+/* trigram_reset - Drop the index */
+void trigram_reset(){
+    for(uint32_t i = 0; i < trigramcap; i++){
+        free(trigrams[i].ids);
+    }
+    free(trigrams);
+    trigrams = NULL;
+    trigramcap = ntrigrams = 0;
+    trigram_built = 0;
+}
+
+/* trigram_has - Whether id is in the list of t */
+static int trigram_has(struct trigram_t *t, uint32_t id){
+    uint32_t lo = 0, hi = t->n;
+
+    while(lo < hi){
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(t->ids[mid] < id){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    return lo < t->n && t->ids[lo] == id;
+}
+
+/*
+ * history_search - Put in hits the commands of the history that hold
+ *    pat, as off[] indexes, newest first and each command only once.
+ *    hits has room for history_count() of them. Returns how many.
+ */
+size_t history_search(const char *pat, size_t plen, size_t *hits){
+    size_t count = history_count(), first = histlog.n - count, nhits = 0, len;
+    char * s;
+
+    if(plen < 3){   // too short for the index
+        for(size_t i = histlog.n; i-- > first; ){
+            s = history_entry(i, &len);
+            if(memmem(s, len, pat, plen) != NULL){
+                hits[nhits++] = i;
+            }
+        }
+    }else{
+        trigram_build();
+
+        struct trigram_t ** lists = malloc((plen - 2) * sizeof(struct trigram_t *));
+        struct trigram_t * rarest = NULL;
+        if(lists == NULL){
+            unix_error("malloc error");
+        }
+        for(size_t k = 0; k + 3 <= plen; k++){
+            if((lists[k] = trigram_get(trigram_key(pat + k), 0)) == NULL){
+                free(lists);
+                return 0;
+            }
+            if(rarest == NULL || lists[k]->n < rarest->n){
+                rarest = lists[k];
+            }
+        }
+        for(uint32_t j = rarest->n; j-- > 0; ){
+            long i = rarest->ids[j] - histlog.idbase;
+            size_t k;
+            if(i < (long)first){
+                break;  // compacted away
+            }
+            for(k = 0; k + 3 <= plen && (lists[k] == rarest || trigram_has(lists[k], rarest->ids[j])); k++)
+                ;
+            s = history_entry(i, &len);
+            if(k + 3 > plen && memmem(s, len, pat, plen) != NULL){
+                hits[nhits++] = i;
+            }
+        }
+        free(lists);
+    }
+
+    // keep the newest of each command
+    size_t cap = 16, kept = 0;
+    while(cap < nhits * 2){
+        cap *= 2;
+    }
+    size_t * seen = calloc(cap, sizeof(size_t));   // i + 1 of each command kept
+    if(seen == NULL){
+        unix_error("calloc error");
+    }
+    for(size_t j = 0; j < nhits; j++){
+        uint64_t h = 0;
+        size_t slot;
+        s = history_entry(hits[j], &len);
+        for(size_t k = 0; k < len; k++){
+            h = h * 31 + (unsigned char)s[k];
+        }
+        for(slot = h & (cap - 1); seen[slot] != 0; slot = (slot + 1) & (cap - 1)){
+            size_t olen;
+            char * o = history_entry(seen[slot] - 1, &olen);
+            if(olen == len && memcmp(o, s, len) == 0){
+                break;
+            }
+        }
+        if(seen[slot] == 0){
+            seen[slot] = hits[j] + 1;
+            hits[kept++] = hits[j];
+        }
+    }
+    free(seen);
+    return kept;
+}
+
+/* 
+ * eval - Evaluate the command line that the user has just typed in
+ * 
+ * The line is split into tokens once, then each job in it (jobs are
+ * separated by ';' or '&') is parsed and run by eval_job in turn.
+ * History references (!!, !n, ...) are expanded first, and the line is
+ * added to the history as it is run. Everything allocated for the line
+ * lives in the arena and is released on return.
+*/
+void eval(char *cmdline) 
+{
+    char **argv;
+    struct cmd_t *cmds;
+    struct arena_mark_t mark = arena_mark();
+    struct token_t *toks, *tok, *first;
+    int bg, ncmds;
+    uint64_t t = now_ns(), parse;
+
+    if(expand_mode && strchr(cmdline, '!') != NULL && (cmdline = expand_history(cmdline)) == NULL){
+        arena_release(mark);
+        return;
+    }
+    if(lexline(cmdline, &toks) < 0){
+        arena_release(mark);
+        return;
+    }
+    parse = now_ns() - t;
+
+    if(toks[0].type != TOK_END)
+        add_history(cmdline);
+
+    for(tok = toks; tok->type != TOK_END; ){
+        first = tok;
+        t = now_ns();
+        bg = parseline(&tok, &argv, &cmds, &ncmds);
+        parse += now_ns() - t;
+        if(bg < 0){
+            break;
+        }
+        if(argv[0] == NULL){
+            continue;
+        }
+
+        if(first == toks && tok->type == TOK_END){
+            eval_job(cmdline, argv, cmds, ncmds, bg);
+        }else{  // the job's own part of the line, for jobs to show
+            const char * end = tok[-1].type == TOK_SEMI ? tok[-2].end : tok[-1].end;
+            size_t len = end - first->begin;
+            char * jobline = arena_alloc(len + 2);
+            memcpy(jobline, first->begin, len);
+            jobline[len] = '\n';
+            jobline[len + 1] = '\0';
+            eval_job(jobline, argv, cmds, ncmds, bg);
+        }
+    }
+    hist_add(&hist_parse, parse);
+    arena_release(mark);
+}
+
+/*
+ * eval_job - Run one parsed job
+ *
+ * If the user has requested a built-in command (quit, jobs, bg or fg)
+ * then execute it immediately. Otherwise, start every stage of the
+ * pipeline, connected by pipes, and run them as one job. If the job is
+ * running in the foreground, wait for it to terminate and then return.
+ * Note: each job must have a unique process group ID, shared by all
+ * of its processes, so that our background children don't receive
+ * SIGINT (SIGTSTP) from the kernel when we type ctrl-c (ctrl-z) at the
+ * keyboard.
+ */
+void eval_job(char *cmdline, char **argv, struct cmd_t *cmds, int ncmds, int bg)
+{
+    char **paths = arena_alloc(ncmds * sizeof(char *));
+    pid_t *pids = arena_alloc(ncmds * sizeof(pid_t));
+    char **names = arena_alloc(ncmds * sizeof(char *));
+    int npids, i, timed = 0;
+    pid_t pid, pgid;
+    uint64_t start = now_ns();
+    struct rusage self;
+
+    if(strcmp(argv[0], "time") == 0 && argv[1] != NULL){
+        cmds[0].argv = ++argv;  // time the rest of the job; ps covers background ones
+        timed = !bg;
+        getrusage(RUSAGE_SELF, &self);
+    }
+
+    if(ncmds == 1 && cmds[0].nredirs == 0 && builtin_cmd(argv)){
+        if(timed){
+            print_self_time(now_ns() - start, &self);
+        }
+        return;
+    }
+
+    // open every file now, so that a bad one is reported before any
+    // process is started
+    if(!open_redirs(cmds, ncmds)){
+        return;
+    }
+    if(ncmds == 1 && cmds[0].nredirs > 0 && find_builtin(argv[0]) != NULL){
+        builtin_redir(&cmds[0]);
+        close_redirs(cmds, ncmds);
+        if(timed){  // to the shell's output, not the builtin's
+            print_self_time(now_ns() - start, &self);
+        }
+        return;
+    }
+
+    for(i = 0; i < ncmds; i++){
+        if(i > 0 && is_relay(cmds[i].argv)){
+            paths[i] = NULL;    // run by the shell itself
+        }else if((paths[i] = find_cmd(cmds[i].argv[0])) == NULL){
+            printf("%s: Command not found.\n", cmds[i].argv[0]);   // don't fork just to find out
+            close_redirs(cmds, ncmds);
+            return;
+        }
+    }
+
+    // our buffered output must come out before the children's, and a
+    // forked child must not inherit it
+    if(__fpending(stdout) > 0){
+        fflush(stdout);
+    }
+
+    uint64_t launched = now_ns();
+    int in = -1;    // read end of the pipe from the previous stage
+    pgid = 0;
+    npids = 0;
+    for(i = 0; i < ncmds; i++){
+        int pfd[2] = { -1, -1 };
+        struct dupfd_t *dups = arena_alloc((2 + cmds[i].nredirs) * sizeof(struct dupfd_t));
+        int ndups = 0;
+
+        if(i < ncmds - 1 && pipe2(pfd, O_CLOEXEC) < 0){
+            unix_error("pipe error");
+        }
+        if(in >= 0){
+            dups[ndups++] = (struct dupfd_t){ in, STDIN_FILENO };
+        }
+        if(pfd[1] >= 0){
+            dups[ndups++] = (struct dupfd_t){ pfd[1], STDOUT_FILENO };
+        }
+        for(int r = 0; r < cmds[i].nredirs; r++){   // after the pipes, as in sh
+            dups[ndups++] = (struct dupfd_t){ cmds[i].redirs[r].src, cmds[i].redirs[r].fd };
+        }
+
+        if(paths[i] == NULL){
+            pid = relay(cmds[i].argv, &child_mask, pgid, dups, ndups);
+        }else{
+            pid = launch(paths[i], cmds[i].argv, &child_mask, pgid, dups, ndups);
+        }
+
+        if(in >= 0){
+            close(in);
+        }
+        if(pfd[1] >= 0){
+            close(pfd[1]);
+        }
+        close_redirs(&cmds[i], 1);
+        in = pfd[0];
+
+        if(pid == 0){   // already reported; the rest of the pipeline still runs
+            continue;
+        }
+        if(pgid == 0){
+            pgid = pid;
+        }
+        names[npids] = cmds[i].argv[0];
+        pids[npids++] = pid;
+    }
+
+    if(npids == 0){
+        return;
+    }
+    hist_add(&hist_spawn, now_ns() - launched);
+
+    int state;
+    char stat[3];
+    if(!bg){
+        state = FG;
+        strcpy(stat, "R+");
+        change_proc_stat(shell_pid, "Ss");
+    }else{
+        state = BG;
+        strcpy(stat, "R");
+    }
+    addjob(pgid, pids, npids, state, cmdline);
+
+    for(i = 0; i < npids; i++){
+        add_proc(names[i], pids[i], shell_pid, pgid, stat);
+    }
+
+    if(!bg){
+        waitfg(pgid); 
+        change_proc_stat(shell_pid, "Rs+");
+        if(getjobpid(pgid) == NULL){    // done, not stopped
+            hist_add(&hist_fg, now_ns() - launched);
+        }
+        if(timed){
+            print_time(now_ns() - start, job_rusage(pgid));
+        }
+    }
+    return;
+}
+
+/*
+ * find_cmd - Resolve a command name to the file to execute
+ *
+ * Names containing a '/' are used as they are. Others are searched for
+ * in PATH, and the result, found or not, is remembered in cmdhash. An
+ * entry stays valid until PATH itself changes or the mtime of one of
+ * the directories it depends on does: the directories up to the one it
+ * was found in, or all of them for a miss. Returns a copy in the arena,
+ * as a later lookup for the same line may reset the cache, or NULL if
+ * there is no such command.
+ */
+char * find_cmd(char * name){
+    if(strchr(name, '/') != NULL){
+        return name;
+    }
+
+    char * env = getenv("PATH");
+    if(env == NULL){
+        env = "";
+    }
+    if(pathenv == NULL || strcmp(pathenv, env) != 0){
+        hash_reset();
+        load_path();
+    }
+
+    unsigned int h = 0;
+    for(char * c = name; *c != '\0'; c++){
+        h = h * 31 + (unsigned char)*c;
+    }
+    struct cmdhash_t ** bucket = &cmdhash[h & (CMDHASH_SIZE - 1)];
+
+    struct cmdhash_t * e;
+    for(e = *bucket; e != NULL; e = e->next){
+        if(strcmp(e->name, name) == 0){
+            break;
+        }
+    }
+    if(e != NULL){
+        if(!path_changed(e->path != NULL ? e->dir : npathdirs - 1)){
+            e->hits++;
+            return arena_strdup(e->path);
+        }
+        hash_reset();
+        load_path();
+    }
+
+    if((e = malloc(sizeof(struct cmdhash_t))) == NULL || (e->name = strdup(name)) == NULL){
+        unix_error("malloc error");
+    }
+    e->path = NULL;
+    e->dir = 0;
+    e->hits = 1;
+
+    size_t len = strlen(name);
+    for(int i = 0; i < npathdirs; i++){
+        size_t dlen = strlen(pathdirs[i].dir);
+        char * path = malloc(dlen + len + 2);
+        struct stat st;
+
+        if(path == NULL){
+            unix_error("malloc error");
+        }
+        sprintf(path, "%s/%s", pathdirs[i].dir, name);
+        if(stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0){
+            e->path = path;
+            e->dir = i;
+            break;
+        }
+        free(path);
+    }
+
+    e->next = *bucket;
+    *bucket = e;
+    return arena_strdup(e->path);
+}
+
+/*
+ * load_path - Split the current PATH into pathdirs and record the
+ *    mtime of each directory. An empty component means ".".
+ */
+void load_path(){
+    char * env = getenv("PATH");
+    if(env == NULL){
+        env = "";
+    }
+
+    free(pathenv);
+    pathenv = strdup(env);
+
+    for(int i = 0; i < npathdirs; i++){
+        free(pathdirs[i].dir);
+    }
+    npathdirs = 1;
+    for(char * c = pathenv; *c != '\0'; c++){
+        if(*c == ':'){
+            npathdirs++;
+        }
+    }
+    pathdirs = realloc(pathdirs, npathdirs * sizeof(struct pathdir_t));
+
+    char * start = pathenv;
+    for(int i = 0; i < npathdirs; i++){
+        char * end = strchr(start, ':');
+        size_t len = end != NULL ? (size_t)(end - start) : strlen(start);
+        struct stat st;
+
+        pathdirs[i].dir = len > 0 ? strndup(start, len) : strdup(".");
+        if(stat(pathdirs[i].dir, &st) == 0){
+            pathdirs[i].mtime = st.st_mtim;
+        }else{
+            pathdirs[i].mtime.tv_sec = 0;
+            pathdirs[i].mtime.tv_nsec = 0;
+        }
+        start = end + 1;
+    }
+}
+
+/* path_changed - Has any of pathdirs[0..upto] changed since it was hashed? */
+int path_changed(int upto){
+    for(int i = 0; i <= upto && i < npathdirs; i++){
+        struct stat st;
+        struct timespec mtime = { 0, 0 };
+        if(stat(pathdirs[i].dir, &st) == 0){
+            mtime = st.st_mtim;
+        }
+        if(mtime.tv_sec != pathdirs[i].mtime.tv_sec || mtime.tv_nsec != pathdirs[i].mtime.tv_nsec){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* hash_reset - Forget every remembered command */
+void hash_reset(){
+    for(int i = 0; i < CMDHASH_SIZE; i++){
+        struct cmdhash_t * e = cmdhash[i];
+        while(e != NULL){
+            struct cmdhash_t * next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        cmdhash[i] = NULL;
+    }
+}
+
+/* list_hash - Print the remembered commands */
+void list_hash(){
+    int empty = 1;
+    for(int i = 0; i < CMDHASH_SIZE; i++){
+        for(struct cmdhash_t * e = cmdhash[i]; e != NULL; e = e->next){
+            if(empty){
+                printf("hits\tcommand\n");
+                empty = 0;
+            }
+            if(e->path != NULL){
+                printf("%4d\t%s\n", e->hits, e->path);
+            }else{
+                printf("%4d\t%s (not found)\n", e->hits, e->name);
+            }
+        }
+    }
+    if(empty){
+        printf("hash table empty\n");
+    }
+}
+
+/* do_hash - Execute the builtin hash command */
+void do_hash(char ** argv){
+    if(argv[1] == NULL){
+        list_hash();
+    }else if(strcmp(argv[1], "-r") == 0){
+        hash_reset();
+    }else{
+        printf("usage: hash [-r]\n");
+    }
+}
+
+/*
+ * launch - Start the file path in process group pgid (a new one if
+ *    pgid is 0) with the descriptors in dups set up and the signal
+ *    mask set to mask, using the strategy selected by launch_mode.
+ *
+ * fork copies the page tables of the shell, so its cost grows with the
+ * shell's resident set; posix_spawn and clone(CLONE_VM|CLONE_VFORK)
+ * share the parent's memory until the execve. Returns the child's pid,
+ * or 0 if the command could not be started (the error is already
+ * reported). The child's signals are reset to their defaults by exec;
+ * the shell blocks its own for good, so mask is what the child gets.
+ */
+pid_t launch(char *path, char **argv, sigset_t *mask, pid_t pgid, struct dupfd_t *dups, int ndups){
+    pid_t pid;
+
+    if(launch_mode == LAUNCH_SPAWN){
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_t actions;
+        int err;
+
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setsigmask(&attr, mask);
+        posix_spawn_file_actions_init(&actions);
+        for(int i = 0; i < ndups; i++){
+            posix_spawn_file_actions_adddup2(&actions, dups[i].fd, dups[i].target);
+        }
+        err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+
+        if(err != 0){
+            launch_error(argv[0], err);
+            return 0;
+        }
+        return pid;
+    }
+
+    if(launch_mode == LAUNCH_VFORK){
+        static char stack[LAUNCH_STACK] __attribute__((aligned(16)));
+        struct vfork_args args = { path, argv, mask, pgid, dups, ndups, 0 };
+
+        // the parent is suspended until the child execs or exits, so the
+        // static stack and args can't be reused under our feet
+        pid = clone(vfork_child, stack + LAUNCH_STACK, CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+        if(pid < 0){
+            unix_error("clone error");
+        }
+        if(args.err != 0){
+            waitpid(pid, NULL, 0);  // it never joins a job, so reap it here
+            launch_error(argv[0], args.err);
+            return 0;
+        }
+        return pid;
+    }
+
+    if((pid = fork()) == 0){
+        sigprocmask(SIG_SETMASK, mask, NULL);   // unblock, a pending ctrl-c kills us here
+        setpgid(0, pgid);                       // put child in the job's process group
+        for(int i = 0; i < ndups; i++){
+            if(dup2(dups[i].fd, dups[i].target) < 0){
+                launch_error(argv[0], errno);
+                exit(1);
+            }
+        }
+        if(execve(path, argv, environ) < 0){
+            launch_error(argv[0], errno);
+            exit(1);
+        }
+    }
+    if(pid < 0){
+        unix_error("fork error");
+    }
+    setpgid(pid, pgid != 0 ? pgid : pid);   // whichever of us runs first
+    return pid;
+}
+
+/*
+ * vfork_child - Body of a LAUNCH_VFORK child. It runs on the parent's
+ *    memory, so it only touches the kernel. The shell has no signal
+ *    handlers that could run in here.
+ */
+int vfork_child(void *arg){
+    struct vfork_args * args = arg;
+
+    sigprocmask(SIG_SETMASK, args->mask, NULL);
+    setpgid(0, args->pgid);
+    for(int i = 0; i < args->ndups; i++){
+        if(dup2(args->dups[i].fd, args->dups[i].target) < 0){
+            args->err = errno;
+            _exit(1);
+        }
+    }
+    execve(args->path, args->argv, environ);
+    args->err = errno;  // seen by the parent, which shares our memory
+    _exit(1);
+}
+
+/* launch_error - Report why argv0 could not be started */
+void launch_error(char *argv0, int err){
+    if(err == ENOENT){
+        printf("%s: Command not found.\n", argv0);
+    }else{
+        printf("%s: %s\n", argv0, strerror(err));
+    }
+}
+
+/*
+ * open_redirs - Open the files of every redirection in the pipeline
+ *
+ * The descriptors are close-on-exec and numbered REDIR_FDMIN or above,
+ * so they can't be clobbered by the dup2s of a redirection like 3>file
+ * and don't leak into the children. On failure, reports it, closes
+ * whatever was opened and returns 0.
+ */
+int open_redirs(struct cmd_t *cmds, int ncmds){
+    for(int i = 0; i < ncmds; i++){
+        for(int j = 0; j < cmds[i].nredirs; j++){
+            struct redir_t * r = &cmds[i].redirs[j];
+            if(r->file == NULL){
+                continue;
+            }
+            int fd = open(r->file, r->flags | O_CLOEXEC, 0666);
+            if(fd >= 0 && fd < REDIR_FDMIN){
+                int high = fcntl(fd, F_DUPFD_CLOEXEC, REDIR_FDMIN);
+                close(fd);
+                fd = high;
+            }
+            if(fd < 0){
+                printf("%s: %s\n", r->file, strerror(errno));
+                cmds[i].nredirs = j;    // only close what was opened
+                close_redirs(cmds, i + 1);
+                return 0;
+            }
+            r->src = fd;
+        }
+    }
+    return 1;
+}
+
+/* close_redirs - Close the files opened by open_redirs */
+void close_redirs(struct cmd_t *cmds, int ncmds){
+    for(int i = 0; i < ncmds; i++){
+        for(int j = 0; j < cmds[i].nredirs; j++){
+            if(cmds[i].redirs[j].file != NULL && cmds[i].redirs[j].src >= 0){
+                close(cmds[i].redirs[j].src);
+                cmds[i].redirs[j].src = -1;
+            }
+        }
+    }
+}
+
+/*
+ * builtin_redir - Run cmd as a builtin with its redirections applied to
+ *    the shell itself, putting the shell's own descriptors back after.
+ *    Returns what builtin_cmd returned.
+ */
+int builtin_redir(struct cmd_t *cmd){
+    int *saved = arena_alloc(cmd->nredirs * sizeof(int));
+    int ret;
+
+    fflush(stdout);
+    for(int i = 0; i < cmd->nredirs; i++){
+        saved[i] = fcntl(cmd->redirs[i].fd, F_DUPFD_CLOEXEC, REDIR_FDMIN);
+        if(dup2(cmd->redirs[i].src, cmd->redirs[i].fd) < 0){
+            printf("%d: %s\n", cmd->redirs[i].src, strerror(errno));
+            cmd->nredirs = i + 1;
+            ret = 1;
+            goto restore;
+        }
+    }
+    ret = builtin_cmd(cmd->argv);
+
+restore:
+    fflush(stdout);
+    for(int i = cmd->nredirs - 1; i >= 0; i--){
+        if(saved[i] >= 0){
+            dup2(saved[i], cmd->redirs[i].fd);
+            close(saved[i]);
+        }else{
+            close(cmd->redirs[i].fd);
+        }
+    }
+    return ret;
+}
+
+/*
+ * is_relay - Can this pipeline stage be run by the in-shell tee relay?
+ *    Only "tee [-a] file..." is, anything else goes to the real tee.
+ */
+int is_relay(char ** argv){
+    if(strcmp(argv[0], "tee") != 0){
+        return 0;
+    }
+    for(int i = 1; argv[i] != NULL; i++){
+        if(argv[i][0] == '-' && strcmp(argv[i], "-a") != 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * relay - Like launch, but the child is a copy of the shell running
+ *    tee_relay instead of an exec'd program.
+ */
+pid_t relay(char **argv, sigset_t *mask, pid_t pgid, struct dupfd_t *dups, int ndups){
+    pid_t pid;
+
+    if((pid = fork()) == 0){
+        setpgid(0, pgid);
+        for(int i = 0; i < ndups; i++){
+            dup2(dups[i].fd, dups[i].target);
+        }
+        close_range(3, ~0U, 0); // nothing but our own ends of the pipes
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        _exit(tee_relay(argv));
+    }
+    if(pid < 0){
+        unix_error("fork error");
+    }
+    setpgid(pid, pgid != 0 ? pgid : pid);
+    return pid;
+}
+
+/*
+ * tee_relay - Copy stdin to stdout and to every file named in argv
+ *
+ * When stdin is a pipe the data never reaches user space: each round,
+ * tee(2) duplicates what is buffered in stdin into one private pipe
+ * per file, those are spliced into the files, and finally the same
+ * bytes are spliced out of stdin into stdout. Returns the exit status.
+ */
+int tee_relay(char ** argv){
+    int nfiles = 0, append = 0, status = 0, nargs;
+    struct stat st;
+
+    for(nargs = 1; argv[nargs] != NULL; nargs++){
+        if(strcmp(argv[nargs], "-a") == 0){
+            append = 1;
+        }
+    }
+    int * files = malloc(nargs * sizeof(int));
+    int (* pipes)[2] = malloc(nargs * sizeof(int[2]));
+    for(int i = 1; argv[i] != NULL; i++){
+        if(strcmp(argv[i], "-a") == 0){
+            continue;
+        }
+        int fd = open(argv[i], O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+        if(fd < 0){
+            printf("tee: %s: %s\n", argv[i], strerror(errno));
+            fflush(stdout);
+            status = 1;
+            continue;
+        }
+        if(pipe(pipes[nfiles]) < 0){
+            return 1;
+        }
+        files[nfiles++] = fd;
+    }
+
+    if(fstat(STDIN_FILENO, &st) < 0 || !S_ISFIFO(st.st_mode)){
+        char buf[RELAY_CHUNK];
+        ssize_t n;
+        while((n = read(STDIN_FILENO, buf, RELAY_CHUNK)) > 0){
+            for(int j = 0; j < nfiles; j++){
+                if(write(files[j], buf, n) != n){
+                    status = 1;
+                }
+            }
+            if(write(STDOUT_FILENO, buf, n) != n){
+                return 1;
+            }
+        }
+        return n < 0 ? 1 : status;
+    }
+
+    while(1){
+        ssize_t n = RELAY_CHUNK;
+
+        // the private pipes are empty at this point, so each tee copies
+        // the same n bytes from the head of stdin
+        for(int j = 0; j < nfiles; j++){
+            n = tee(STDIN_FILENO, pipes[j][1], n, 0);
+            if(n <= 0){
+                break;
+            }
+        }
+        if(nfiles == 0){
+            n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, RELAY_CHUNK, SPLICE_F_MOVE);
+            if(n < 0 && errno == EINVAL){
+                n = move_bytes(STDIN_FILENO, STDOUT_FILENO, RELAY_CHUNK);
+            }
+            if(n <= 0){
+                return n < 0 ? 1 : status;
+            }
+            continue;
+        }
+        if(n <= 0){
+            return n < 0 ? 1 : status;
+        }
+
+        for(int j = 0; j < nfiles; j++){
+            if(move_bytes(pipes[j][0], files[j], n) < n){
+                status = 1;
+            }
+        }
+        if(move_bytes(STDIN_FILENO, STDOUT_FILENO, n) < n){
+            return 1;
+        }
+    }
+}
+
+/*
+ * move_bytes - Move exactly n bytes from the pipe from to the file to,
+ *    with splice when the kernel supports it for this pair and with
+ *    read/write when it doesn't (O_APPEND files, some terminals).
+ *    Returns the number of bytes moved.
+ */
+int move_bytes(int from, int to, size_t n){
+    char buf[RELAY_CHUNK];
+    size_t done = 0;
+
+    while(done < n){
+        ssize_t m = splice(from, NULL, to, NULL, n - done, SPLICE_F_MOVE);
+        if(m < 0 && errno == EINVAL){
+            m = read(from, buf, n - done < RELAY_CHUNK ? n - done : RELAY_CHUNK);
+            if(m > 0 && write(to, buf, m) != m){
+                m = -1;
+            }
+        }
+        if(m <= 0){
+            break;
+        }
+        done += m;
+    }
+    return done;
+}
+
+
+/* format_status - Lay out a status file in buf, returning its length */
+int format_status(char * buf, size_t size, char * name, pid_t pid, pid_t ppid, pid_t pgid,
+                  pid_t sid, char * stat, char * user){
+    int len = snprintf(buf, size,
+                       "Name: %-*.*s\nPid: %-*d\nPPid: %-*d\nPGid: %-*d\nSid: %-*d\nSTAT: %-*.*s\nUsername: %s\n",
+                       PROC_NAMEW, PROC_NAMEW, name, PROC_NUMW, pid, PROC_NUMW, ppid,
+                       PROC_NUMW, pgid, PROC_NUMW, sid, PROC_STATW, PROC_STATW, stat, user);
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/*
+ * write_proc - Create the status file of a process. Every field before
+ *    Username has a fixed width, padded with blanks, so that STAT's value
+ *    is always PROC_STAT_OFF bytes in and can be rewritten in place.
+ *    Returns the file, still open, or -1 if it was closed.
+ */
+int write_proc(char * name, pid_t pid, pid_t ppid, pid_t pgid, char * stat){
+    char path[MAXLINE], buf[PROC_STAT_OFF + PROC_STATW + MAXLINE];
+    int fd, len;
 
-void write_proc(char * name, pid_t pid, pid_t ppid, char * stat){
-    char path[MAXLINE];
     sprintf(path, "./proc/%d/status", pid);
-    FILE * fp = fopen(path, "w");
+    if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0){
+        unix_error("open");
+    }
+
+    len = format_status(buf, sizeof(buf), name, pid, ppid, pgid, shell_pid, stat, username);
+    if(write(fd, buf, len) != len){
+        unix_error("write error");
+    }
+
+    if(nprocfds >= PROC_FDCACHE){   // don't run the shell out of descriptors
+        close(fd);
+        return -1;
+    }
+    nprocfds++;
+    return fd;
+}
+
+/*
+ * The records of the shell's processes are not written as they change.
+ * add_proc, change_proc_stat and remove_proc note the change in the
+ * process's procs entry, and flush_procs writes only the final state of
+ * each: once per command line, or when the shell is going to wait for
+ * longer than PROC_FLUSH_MS. A foreground command that is done by then
+ * is never written at all, and the shell's Ss and Rs+ around it are one
+ * write.
+ */
+
+/* add_proc - Record a new process */
+void add_proc(char * name, pid_t pid, pid_t ppid, pid_t pgid, char * stat){
+    struct procent_t * e = proc_find(pid);
+
+    if(e != NULL && (e->pending & PROC_GONE)){  // pid reused before the old record went
+        flush_procs();
+    }
+    e = proc_new(pid);
+    e->ppid = ppid;
+    e->pgid = pgid;
+    snprintf(e->stat, sizeof(e->stat), "%s", stat);
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    proc_pend(e, PROC_NEW);
+}
+
+/* change_proc_stat - Set the STAT of process pid */
+void change_proc_stat(pid_t pid, char * stat){
+    struct procent_t * e = proc_find(pid);
+
+    if(e == NULL || (e->pending & PROC_GONE)){
+        return;
+    }
+    if(e->pending & (PROC_NEW | PROC_DIRTY)){
+        proc_coalesced++;   // the earlier value is never written
+    }
+    snprintf(e->stat, sizeof(e->stat), "%s", stat);
+    proc_pend(e, PROC_DIRTY);
+}
+
+/* change_job_stat - Set the STAT of every live process of a job */
+void change_job_stat(struct job_t * job, char * stat){
+    for(int i = 0; i < job->npids; i++){
+        if(job->pids[i] != 0){
+            change_proc_stat(job->pids[i], stat);
+        }
+    }
+}
+
+/* remove_proc - Drop the record of process pid */
+void remove_proc(pid_t pid){
+    struct procent_t * e = proc_find(pid);
+
+    if(e == NULL){
+        return;
+    }
+    if(e->pending & PROC_NEW){
+        proc_coalesced += 2;    // neither created nor removed
+    }else if(e->pending & PROC_DIRTY){
+        proc_coalesced++;
+    }
+    proc_pend(e, PROC_GONE);
+}
+
+/* proc_pend - Note a change to e, queueing it for flush_procs if it had none */
+void proc_pend(struct procent_t *e, int what){
+    if(e->pending == 0){
+        if(ndirty == dirtycap){
+            dirtycap = dirtycap ? dirtycap * 2 : 64;
+            if((procdirty = realloc(procdirty, dirtycap * sizeof(pid_t))) == NULL){
+                unix_error("realloc error");
+            }
+        }
+        procdirty[ndirty++] = e->pid;
+    }
+    e->pending |= what;
+}
+
+/* flush_procs - Write out the pending changes, the last state of each process */
+void flush_procs(){
+    for(int i = 0; i < ndirty; i++){
+        struct procent_t * e = proc_find(procdirty[i]);
+        if(e == NULL){
+            continue;
+        }
+        int what = e->pending;
+        e->pending = 0;
+
+        if((what & PROC_NEW) && (what & PROC_GONE)){
+            proc_del(e->pid);
+            continue;
+        }
+        if(what & PROC_NEW){
+            proc_create(e);
+        }else if((what & PROC_DIRTY) && strcmp(e->stat, e->wstat) == 0){
+            proc_coalesced++;   // changed and changed back
+        }else if(what & PROC_DIRTY){
+            proc_write_stat(e);
+        }
+        if(what & PROC_GONE){
+            proc_unlink(e);
+            proc_del(e->pid);
+        }
+    }
+    ndirty = 0;
+}
+
+/* proc_create - Write the record of a new process */
+void proc_create(struct procent_t *e){
+    proc_writes++;
+    strcpy(e->wstat, e->stat);
+    if(proc_mode == PROC_SHM){
+        e->ref = reg_add(e->name, e->pid, e->ppid, e->pgid, e->stat);
+        return;
+    }
+
+    char path[MAXLINE];
+    sprintf(path, "./proc/%d", e->pid);
+    if(mkdir(path, 0777) != 0){
+        unix_error("mkdir error");
+    }
+    e->ref = write_proc(e->name, e->pid, e->ppid, e->pgid, e->stat);
+}
+
+/*
+ * proc_write_stat - Write a new STAT: one pwrite over the old value,
+ *    on the file write_proc left open if there is one.
+ */
+void proc_write_stat(struct procent_t *e){
+    proc_writes++;
+    strcpy(e->wstat, e->stat);
+    if(proc_mode == PROC_SHM){
+        if(e->ref >= 0){
+            reg_set_stat(e->ref, e->stat);
+        }
+        return;
+    }
+
+    char val[PROC_STATW + 1];
+    int fd = e->ref;
+    snprintf(val, sizeof(val), "%-*.*s", PROC_STATW, PROC_STATW, e->stat);
+    if(fd < 0){
+        char path[MAXLINE];
+        sprintf(path, "./proc/%d/status", e->pid);
+        if((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0){
+            unix_error("open");
+        }
+    }
+    if(pwrite(fd, val, PROC_STATW, PROC_STAT_OFF) != PROC_STATW){
+        unix_error("pwrite error");
+    }
+    if(e->ref < 0){
+        close(fd);
+    }
+}
+
+/* proc_unlink - Remove the record of a process */
+void proc_unlink(struct procent_t *e){
+    proc_writes++;
+    if(proc_mode == PROC_SHM){
+        if(e->ref >= 0){
+            reg_remove(e->ref);
+        }
+        char path[MAXLINE];    // and what proc -x may have exported of it
+        sprintf(path, "./proc/%d/status", e->pid);
+        if(unlink(path) == 0){
+            sprintf(path, "./proc/%d", e->pid);
+            rmdir(path);
+        }
+        return;
+    }
+    if(e->ref >= 0){
+        close(e->ref);
+        nprocfds--;
+    }
+
+    char path[MAXLINE];
+    sprintf(path, "./proc/%d/status", e->pid);
+    if(remove(path) != 0){
+        unix_error("remove error");
+    }
+
+    sprintf(path, "./proc/%d", e->pid);
+    if(rmdir(path) != 0){ // remove directory only if it's empty
+        unix_error("rmdir error");
+    }
+}
+
+/*
+ * The shared registry (-r shm) keeps the same fields as the status
+ * files in fixed slots of ./proc/.registry, mapped by every tsh using
+ * this tree. A shell claims a free slot with a compare-and-swap on its
+ * pid and is then the only writer of that slot, so no lock is taken:
+ * each slot has a sequence count that is odd while its owner writes
+ * it, and readers copy the slot and retry if the count moved. A slot
+ * is looked up from pid % nslots onwards; freed slots get pid -1 so
+ * the search can go past them, claimed but unwritten ones pid -2.
+ */
+
+/*
+ * proc_start - When process pid started, in clock ticks since boot,
+ *    from /proc/<pid>/stat; with the pid it names one process for good.
+ *    0 if it cannot be read.
+ */
+uint64_t proc_start(pid_t pid){
+    char path[64], buf[512];
+    unsigned long long start;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0){
+        return 0;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0){
+        return 0;
+    }
+    buf[n] = '\0';
+
+    char * p = strrchr(buf, ')');   // as in sample_proc
+    if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u "
+                           "%*d %*d %*d %*d %*d %*d %llu", &start) != 1){
+        return 0;
+    }
+    return start;
+}
+
+/*
+ * proc_stale - Is st, the status file of pid, left over: pid is gone,
+ *    or is now a process that started after the file was last written.
+ */
+int proc_stale(pid_t pid, struct stat *st){
+    static long tick;
+    static time_t btime;
+    uint64_t start;
+
+    if(kill(pid, 0) < 0 && errno == ESRCH){
+        return 1;
+    }
+    if(tick == 0){
+        char line[128];
+        FILE * fp = fopen("/proc/stat", "r");
+        tick = sysconf(_SC_CLK_TCK);
+        while(fp != NULL && fgets(line, sizeof(line), fp) != NULL){
+            if(sscanf(line, "btime %ld", &btime) == 1){
+                break;
+            }
+        }
+        if(fp != NULL){
+            fclose(fp);
+        }
+    }
+    if(btime == 0 || (start = proc_start(pid)) == 0){
+        return 0;   // no way to tell
+    }
+    return btime + (time_t)(start / tick) > st->st_mtime + 1;  // btime is in whole seconds
+}
+
+/* reg_open - Map the registry, creating it if this is the first shell */
+void reg_open(){
+    struct stat st;
+    size_t size = sizeof(struct registry_t) + PROC_SLOTS * sizeof(struct regslot_t);
+    int fd = open(REG_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+
+    if(fd < 0 || fstat(fd, &st) < 0){
+        unix_error(REG_PATH);
+    }
+    if(st.st_size == 0 && ftruncate(fd, size) < 0){    // zero-filled: every slot unused
+        unix_error("ftruncate error");
+    }else if(st.st_size != 0){
+        size = st.st_size;
+    }
+    reg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(reg == MAP_FAILED){
+        unix_error("mmap error");
+    }
+    close(fd);
+
+    uint32_t zero = 0;  // whoever comes first sets the size
+    __atomic_compare_exchange_n(&reg->nslots, &zero, PROC_SLOTS, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    zero = 0;
+    __atomic_compare_exchange_n(&reg->slotsize, &zero, sizeof(struct regslot_t), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if(reg->slotsize != sizeof(struct regslot_t)){
+        app_error(REG_PATH " has another layout: remove it once no tsh uses it");
+    }
+    regslots = (size - sizeof(struct registry_t)) / sizeof(struct regslot_t);
+    if(reg->nslots < regslots){
+        regslots = reg->nslots;
+    }
+
+    // take back the slots of shells that died without cleaning up,
+    // also when their pid has been given to another process since
+    shell_start = proc_start(shell_pid);
+    for(uint32_t i = 0; i < regslots; i++){
+        int32_t pid = __atomic_load_n(&reg->slots[i].pid, __ATOMIC_ACQUIRE);
+        pid_t sid = reg->slots[i].sid;
+        if(pid > 0 && sid > 0 && ((kill(sid, 0) < 0 && errno == ESRCH) ||
+                                  proc_start(sid) != reg->slots[i].sstart)){
+            __atomic_compare_exchange_n(&reg->slots[i].pid, &pid, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* reg_begin - Start changing a slot we own */
+static inline void reg_begin(struct regslot_t *s){
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* reg_end - Publish the changes to a slot */
+static inline void reg_end(struct regslot_t *s){
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* reg_add - Claim a slot for pid and fill it in. Returns the slot, -1 if full */
+int reg_add(char * name, pid_t pid, pid_t ppid, pid_t pgid, char * stat){
+    for(uint32_t n = 0, i = pid % regslots; n < regslots; n++, i = (i + 1) % regslots){
+        struct regslot_t *s = &reg->slots[i];
+        int32_t cur = __atomic_load_n(&s->pid, __ATOMIC_RELAXED);
+        if((cur != 0 && cur != -1) ||
+           !__atomic_compare_exchange_n(&s->pid, &cur, -2, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            continue;
+        }
+        uint32_t seq = s->seq;
+        if(seq & 1){    // its last owner died halfway through a change
+            __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+        }
+        reg_begin(s);
+        s->ppid = ppid;
+        s->pgid = pgid;
+        s->sid = shell_pid;
+        s->sstart = shell_start;
+        strncpy(s->stat, stat, sizeof(s->stat) - 1);
+        strncpy(s->name, name, sizeof(s->name) - 1);
+        strncpy(s->user, username, sizeof(s->user) - 1);
+        s->stat[sizeof(s->stat) - 1] = s->name[sizeof(s->name) - 1] = s->user[sizeof(s->user) - 1] = '\0';
+        __atomic_store_n(&s->pid, pid, __ATOMIC_RELEASE);
+        reg_end(s);
+        return i;
+    }
+    printf("process registry full, %d not recorded\n", pid);
+    return -1;
+}
+
+/* reg_set_stat - Change the STAT of the process in slot i */
+void reg_set_stat(int i, char * stat){
+    struct regslot_t *s = &reg->slots[i];
+
+    reg_begin(s);
+    strncpy(s->stat, stat, sizeof(s->stat) - 1);
+    reg_end(s);
+}
+
+/*
+ * reg_remove - Give slot i back. The pid is published alone, after the
+ *    last change to the slot has ended: once it is -1 another shell
+ *    may claim the slot and start counting seq itself.
+ */
+void reg_remove(int i){
+    struct regslot_t *s = &reg->slots[i];
+
+    __atomic_store_n(&s->pid, -1, __ATOMIC_RELEASE);
+}
+
+/* reg_read - Copy a consistent view of slot i to out. Returns 0 if the slot is unused */
+int reg_read(uint32_t i, struct regslot_t *out){
+    struct regslot_t *s = &reg->slots[i];
+    uint32_t seq;
+    int spins = 0;
+
+    do{
+        while((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1){
+            if(++spins > 1000){ // its owner died halfway through
+                return 0;
+            }
+            sched_yield();
+        }
+        memcpy(out, s, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }while(__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq);
+    out->stat[sizeof(out->stat) - 1] = out->name[sizeof(out->name) - 1] = out->user[sizeof(out->user) - 1] = '\0';
+    return out->pid > 0;
+}
+
+/* proc_find - The shell's entry for its process pid, NULL if it has none */
+struct procent_t *proc_find(pid_t pid){
+    uint32_t mask = proccap - 1, i;
+
+    if(proccap == 0){
+        return NULL;
+    }
+    for(i = pid & mask; procs[i].pid != 0; i = (i + 1) & mask){
+        if(procs[i].pid == pid){
+            return &procs[i];
+        }
+    }
+    return NULL;
+}
+
+/* proc_new - Make an entry for pid, with no record yet */
+struct procent_t *proc_new(pid_t pid){
+    uint32_t mask, i;
+
+    if((nprocs + 1) * 2 > proccap){    // at most half full
+        struct procent_t *old = procs;
+        uint32_t oldcap = proccap;
+        proccap = proccap ? proccap * 2 : 64;
+        if((procs = calloc(proccap, sizeof(struct procent_t))) == NULL){
+            unix_error("calloc error");
+        }
+        nprocs = 0;
+        for(i = 0; i < oldcap; i++){
+            if(old[i].pid != 0){
+                *proc_new(old[i].pid) = old[i];
+            }
+        }
+        free(old);
+    }
+    mask = proccap - 1;
+    for(i = pid & mask; procs[i].pid != 0 && procs[i].pid != pid; i = (i + 1) & mask)
+        ;
+    if(procs[i].pid == 0){
+        nprocs++;
+    }
+    memset(&procs[i], 0, sizeof(procs[i]));
+    procs[i].pid = pid;
+    procs[i].ref = -1;
+    return &procs[i];
+}
+
+/* proc_del - Forget pid's handle, shifting the rest of its run back */
+void proc_del(pid_t pid){
+    uint32_t mask = proccap - 1, i, j, k;
+
+    for(i = pid & mask; procs[i].pid != pid; i = (i + 1) & mask){
+        if(procs[i].pid == 0){
+            return;
+        }
+    }
+    for(j = (i + 1) & mask; procs[j].pid != 0; j = (j + 1) & mask){
+        k = procs[j].pid & mask;
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j)){
+            continue;
+        }
+        procs[i] = procs[j];
+        i = j;
+    }
+    procs[i].pid = 0;
+    nprocs--;
+}
+
+/*
+ * builtin_proc - List the processes of every session in this tree, or
+ *    with -x, write them out as ./proc/<pid>/status files, the layout
+ *    of the default backend, for tools that read that. -s counts the
+ *    record changes written and those coalesced away.
+ */
+void builtin_proc(char **argv){
+    struct regslot_t s;
+
+    if(argv[1] != NULL && strcmp(argv[1], "-x") != 0 && strcmp(argv[1], "-s") != 0){
+        printf("usage: proc [-x | -s]\n");
+        return;
+    }
+    flush_procs();
+    if(argv[1] != NULL && strcmp(argv[1], "-s") == 0){
+        printf("%lu written, %lu coalesced\n", proc_writes, proc_coalesced);
+        return;
+    }
+    if(proc_mode != PROC_SHM){
+        if(argv[1] != NULL){
+            printf("proc: -x needs the shm registry (tsh -r shm)\n");
+            return;
+        }
+        list_proc_files();
+        return;
+    }
+
+    if(argv[1] == NULL){
+        printf("%7s %7s %7s %7s %-4s %-10s %s\n", "PID", "PPID", "PGID", "SID", "STAT", "USER", "NAME");
+    }
+    for(uint32_t i = 0; i < regslots; i++){
+        if(!reg_read(i, &s)){
+            continue;
+        }
+        if(argv[1] == NULL){
+            printf("%7d %7d %7d %7d %-4s %-10s %s\n", s.pid, s.ppid, s.pgid, s.sid, s.stat, s.user, s.name);
+            continue;
+        }
+
+        char path[MAXLINE];
+        sprintf(path, "./proc/%d", s.pid);
+        if(mkdir(path, 0777) != 0 && errno != EEXIST){
+            unix_error("mkdir error");
+        }
+        strcat(path, "/status");
+        char buf[PROC_STAT_OFF + PROC_STATW + sizeof(s.user) + 16];
+        int len = format_status(buf, sizeof(buf), s.name, s.pid, s.ppid, s.pgid, s.sid, s.stat, s.user);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if(fd < 0 || write(fd, buf, len) != len){
+            unix_error(path);
+        }
+        close(fd);
+    }
+}
+
+/*
+ * read_status - Read a status file into out. Values are trimmed, so
+ *    this reads files in the padded layout of write_proc as well as in
+ *    the free-form one older shells wrote. Returns 0 if it can't.
+ */
+int read_status(const char * path, struct regslot_t * out){
+    char line[MAXLINE];
+    int seen = 0;
+    FILE * fp = fopen(path, "r");
+
     if(fp == NULL){
-        unix_error("fopen");
+        return 0;
+    }
+    memset(out, 0, sizeof(*out));
+    while(fgets(line, sizeof(line), fp) != NULL){
+        char * v = strchr(line, ':');
+        if(v == NULL){
+            continue;
+        }
+        *v++ = '\0';
+        v += strspn(v, " \t");
+        size_t n = strcspn(v, "\n");
+        while(n > 0 && v[n - 1] == ' '){
+            n--;
+        }
+        v[n] = '\0';
+
+        if(strcmp(line, "Name") == 0){
+            snprintf(out->name, sizeof(out->name), "%s", v);
+        }else if(strcmp(line, "Pid") == 0){
+            out->pid = atoi(v);
+        }else if(strcmp(line, "PPid") == 0){
+            out->ppid = atoi(v);
+        }else if(strcmp(line, "PGid") == 0){
+            out->pgid = atoi(v);
+        }else if(strcmp(line, "Sid") == 0){
+            out->sid = atoi(v);
+        }else if(strcmp(line, "STAT") == 0){
+            snprintf(out->stat, sizeof(out->stat), "%s", v);
+        }else if(strcmp(line, "Username") == 0){
+            snprintf(out->user, sizeof(out->user), "%s", v);
+        }else{
+            continue;
+        }
+        seen++;
+    }
+    fclose(fp);
+    return seen == 7;
+}
+
+/* list_proc_files - proc for the default backend: print every ./proc/<pid>/status not left over (proc_stale) */
+void list_proc_files(){
+    DIR * dir = opendir("./proc");
+    struct dirent * de;
+    struct regslot_t s;
+    struct stat st;
+    char path[MAXLINE];
+
+    if(dir == NULL){
+        unix_error("opendir error");
+    }
+    printf("%7s %7s %7s %7s %-4s %-10s %s\n", "PID", "PPID", "PGID", "SID", "STAT", "USER", "NAME");
+    while((de = readdir(dir)) != NULL){
+        if(!isdigit((unsigned char)de->d_name[0])){
+            continue;
+        }
+        snprintf(path, sizeof(path), "./proc/%s/status", de->d_name);
+        if(stat(path, &st) == 0 && read_status(path, &s) &&    // it may have gone since readdir
+           !proc_stale(s.pid, &st)){   // or be left by a shell that died
+            printf("%7d %7d %7d %7d %-4s %-10s %s\n", s.pid, s.ppid, s.pgid, s.sid, s.stat, s.user, s.name);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * arena_alloc - Hand out n bytes that stay valid until the arena is
+ *    released past them. Blocks are kept across releases, so once the
+ *    arena has grown to fit the longest line seen, nothing is malloc'd.
+ */
+void *arena_alloc(size_t n){
+    n = (n + 15) & ~(size_t)15;
+    if(arena_cur == NULL){
+        size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        arena_first = arena_cur = malloc(sizeof(struct arena_block_t) + size);
+        if(arena_cur == NULL){
+            unix_error("malloc error");
+        }
+        arena_cur->next = NULL;
+        arena_cur->size = size;
+        arena_cur->used = 0;
+    }
+    while(arena_cur->size - arena_cur->used < n){
+        struct arena_block_t * next = arena_cur->next;
+        if(next == NULL || next->size < n){ // blocks past arena_cur are free
+            size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+            struct arena_block_t * b = malloc(sizeof(struct arena_block_t) + size);
+            if(b == NULL){
+                unix_error("malloc error");
+            }
+            b->next = next;
+            b->size = size;
+            arena_cur->next = b;
+            next = b;
+        }
+        arena_cur = next;
+        arena_cur->used = 0;
+    }
+
+    void * p = arena_cur->data + arena_cur->used;
+    arena_cur->used += n;
+    return p;
+}
+
+/* arena_strdup - Copy s into the arena; NULL stays NULL */
+char *arena_strdup(const char *s){
+    if(s == NULL){
+        return NULL;
+    }
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(len), s, len);
+}
+
+/* arena_mark - Remember how much of the arena is in use */
+struct arena_mark_t arena_mark(){
+    struct arena_mark_t mark = { arena_cur, arena_cur != NULL ? arena_cur->used : 0 };
+    return mark;
+}
+
+/* arena_release - Free everything allocated since mark was taken */
+void arena_release(struct arena_mark_t mark){
+    if(mark.block != NULL){
+        arena_cur = mark.block;
+        arena_cur->used = mark.used;
+    }else if(arena_first != NULL){
+        arena_cur = arena_first;
+        arena_cur->used = 0;
+    }
+}
+
+/* scan_scalar - Find the first lex_special byte in [p, end), or end */
+const char *scan_scalar(const char *p, const char *end){
+    while(p < end && !lex_special[(unsigned char)*p]){
+        p++;
+    }
+    return p;
+}
+
+#ifdef LEX_X86
+/*
+ * scan_sse2 - scan_scalar, 16 bytes at a time. The last load may read
+ *    past end, but never into the next page, and those bytes are masked.
+ */
+__attribute__((target("sse2"), no_sanitize_address))
+const char *scan_sse2(const char *p, const char *end){
+    const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), nl = _mm_set1_epi8('\n');
+    const __m128i sq = _mm_set1_epi8('\''), dq = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+    const __m128i amp = _mm_set1_epi8('&'), bar = _mm_set1_epi8('|'), semi = _mm_set1_epi8(';');
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+
+    while(p < end){
+        if(end - p < 16 && ((uintptr_t)p & 4095) > 4096 - 16){
+            return scan_scalar(p, end); // the load could fault past the page
+        }
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, sq)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, bs)),
+                                         _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, bar))));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, semi),
+                                         _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt))));
+        int bits = _mm_movemask_epi8(m);
+        if(end - p < 16){
+            bits |= 1 << (end - p);     // ignore the bytes past end
+        }
+        if(bits != 0){
+            return p + __builtin_ctz(bits);
+        }
+        p += 16;
+    }
+    return end;
+}
+
+/* scan_avx2 - scan_scalar, 32 bytes at a time */
+__attribute__((target("avx2"), no_sanitize_address))
+const char *scan_avx2(const char *p, const char *end){
+    const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), nl = _mm256_set1_epi8('\n');
+    const __m256i sq = _mm256_set1_epi8('\''), dq = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\');
+    const __m256i amp = _mm256_set1_epi8('&'), bar = _mm256_set1_epi8('|'), semi = _mm256_set1_epi8(';');
+    const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>');
+
+    while(p < end){
+        if(end - p < 32 && ((uintptr_t)p & 4095) > 4096 - 32){
+            return scan_sse2(p, end);
+        }
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, sq)));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, dq), _mm256_cmpeq_epi8(v, bs)),
+                                               _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, bar))));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, semi),
+                                               _mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt))));
+        unsigned int bits = _mm256_movemask_epi8(m);
+        if(end - p < 32){
+            bits |= 1u << (end - p);
+        }
+        if(bits != 0){
+            return p + __builtin_ctz(bits);
+        }
+        p += 32;
+    }
+    return end;
+}
+#endif
+
+/* init_lexer - Pick the widest scanner the CPU supports */
+void init_lexer(){
+    scan_special = scan_scalar;
+#ifdef LEX_X86
+    if(__builtin_cpu_supports("avx2")){
+        scan_special = scan_avx2;
+    }else if(__builtin_cpu_supports("sse2")){
+        scan_special = scan_sse2;
     }
+#endif
+}
+
+/*
+ * lexline - Split the command line into tokens
+ *
+ * A word runs until an unquoted blank or one of & | ; < >. Within it,
+ * single quotes keep everything literally, double quotes keep
+ * everything but \" \\ \$ \` and \<newline>, and outside quotes a
+ * backslash keeps the next character. A lone digit right before < or
+ * > is the descriptor to redirect, as in 2>file. Plain runs are found
+ * with scan_special, so most of the line is moved with memcpy.
+ *
+ * The tokens, terminated by a TOK_END, and the words are stored in the
+ * arena. Returns the number of tokens, or -1 (after saying why) if a
+ * quote isn't closed or a redirection is malformed.
+ */
+int lexline(const char *cmdline, struct token_t **toks)
+{
+    size_t len = strlen(cmdline);
+    const char *p = cmdline;        /* ptr that traverses command line */
+    const char *end = cmdline + len;
+    const char *q;
+    char *dst = arena_alloc(len + 1); /* the words; never longer than the line */
+    int cap = 16, n = 0;
+    struct token_t *tok = arena_alloc(cap * sizeof(struct token_t));
+    struct token_t *t;
+    int plain;                      /* no quotes or escapes in the word */
 
-    fprintf(fp, "Name: %s\n", name);
-    fprintf(fp, "Pid: %d\n", pid);
-    fprintf(fp, "PPid: %d\n", ppid);
-    fprintf(fp, "PGid: %d\n", pid);
-    fprintf(fp, "Sid: %d\n", shell_pid);
+    while (1) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n')) /* ignore spaces */
+	    p++;
+	if (n == cap) {
+	    struct token_t *more = arena_alloc(2 * cap * sizeof(struct token_t));
+	    memcpy(more, tok, cap * sizeof(struct token_t));
+	    tok = more;
+	    cap *= 2;
+	}
 
-    fprintf(fp, "STAT: %s\n", stat);
+	t = &tok[n];
+	t->begin = p;
+	t->text = NULL;
+	t->fd = -1;
+	t->src = -1;
+	if (p == end) {
+	    t->type = TOK_END;
+	    t->end = p;
+	    break;
+	}
 
-    fprintf(fp, "Username: %s\n", username);
-    fclose(fp);
-}
+	switch (*p) {
+	case '|':
+	    t->type = TOK_PIPE;
+	    p++;
+	    break;
+	case '&':
+	    t->type = TOK_AMP;
+	    p++;
+	    break;
+	case ';':
+	    t->type = TOK_SEMI;
+	    p++;
+	    break;
+	case '<':
+	case '>':
+	    if ((p = lex_redir(p, end, t, -1)) == NULL)
+		return -1;
+	    break;
+	default:
+	    t->type = TOK_WORD;
+	    t->text = dst;
+	    plain = 1;
+	    while (1) {
+		q = scan_special(p, end);
+		memcpy(dst, p, q - p);
+		dst += q - p;
+		p = q;
+		if (p == end)
+		    break;
+		if (*p == '\'') {
+		    if ((q = memchr(p + 1, '\'', end - p - 1)) == NULL) {
+			printf("unmatched '\n");
+			return -1;
+		    }
+		    memcpy(dst, p + 1, q - p - 1);
+		    dst += q - p - 1;
+		    p = q + 1;
+		}
+		else if (*p == '"') {
+		    if ((p = lex_dquote(p + 1, end, &dst)) == NULL)
+			return -1;
+		}
+		else if (*p == '\\') {
+		    p++;
+		    if (p < end && *p != '\n')
+			*dst++ = *p;
+		    if (p < end)
+			p++;
+		}
+		else
+		    break;
+		plain = 0;
+	    }
 
-void change_proc_stat(pid_t pid, char * stat){
-    char path[MAXLINE];
-    sprintf(path, "./proc/%d/status", pid);
-    FILE * fp = fopen(path, "r+");
-    if(fp == NULL){
-        unix_error("fopen");
+	    if (plain && dst - t->text == 1 && isdigit((unsigned char)t->text[0]) &&
+		p < end && (*p == '<' || *p == '>')) {
+		dst = t->text;
+		if ((p = lex_redir(p, end, t, t->text[0] - '0')) == NULL)
+		    return -1;
+		t->text = NULL;
+		break;
+	    }
+	    *dst++ = '\0';
+	}
+	t->end = p;
+	n++;
     }
 
-    char str[MAXLINE];
+    *toks = tok;
+    return n;
+}
+
+/*
+ * lex_redir - Lex the redirection operator at p into t, redirecting fd
+ *    or, if fd is -1, the default for the operator. Returns where the
+ *    operator ends, or NULL (after saying why) for a [n]>& with no m.
+ */
+const char *lex_redir(const char *p, const char *end, struct token_t *t, int fd)
+{
+    char op = *p++;
 
-    for(int cnt = 0; cnt < 5; cnt++){
-        fgets(str, MAXLINE, fp);
+    t->fd = fd >= 0 ? fd : (op == '<' ? 0 : 1);
+    if (op == '>' && p < end && *p == '>') {
+	t->type = TOK_APPEND;
+	p++;
     }
-    fprintf(fp, "STAT: %s\n", stat);
-    fprintf(fp, "Username: %s\n", username);
-    
-    fclose(fp);
+    else if (p < end && *p == '&') {
+	p++;
+	if (p == end || !isdigit((unsigned char)*p)) {
+	    printf("syntax error near '%c&'\n", op);
+	    return NULL;
+	}
+	t->type = TOK_DUP;
+	t->src = *p++ - '0';
+    }
+    else
+	t->type = op == '<' ? TOK_IN : TOK_OUT;
+    return p;
 }
 
-void add_proc(char * name, pid_t pid, pid_t ppid, char * stat){
-    char path[MAXLINE];
-    sprintf(path, "./proc/%d", pid);
-    if(mkdir(path, 0777) != 0){
-        unix_error("mkdir error");
-    }
+/*
+ * lex_dquote - Copy the inside of the double-quoted string starting at
+ *    p to *dst, and advance *dst. Returns the byte after the closing
+ *    quote, or NULL (after saying why) if there is none.
+ */
+const char *lex_dquote(const char *p, const char *end, char **dst)
+{
+    char *d = *dst;
+    size_t n;
 
-    write_proc(name, pid, ppid, stat);
+    while (1) {
+	n = strcspn(p, "\"\\");     /* the line is NUL-terminated at end */
+	memcpy(d, p, n);
+	d += n;
+	p += n;
+	if (p == end) {
+	    printf("unmatched \"\n");
+	    return NULL;
+	}
+	if (*p == '"')
+	    break;
+	/* a backslash only escapes " \ $ ` and newline in here */
+	if (p + 1 < end && strchr("\"\\$`\n", p[1])) {
+	    if (p[1] != '\n')
+		*d++ = p[1];
+	    p += 2;
+	}
+	else
+	    *d++ = *p++;
+    }
+    *dst = d;
+    return p + 1;
 }
 
 /* 
- * parseline - Parse the command line and build the argv array.
+ * parseline - Parse one job of the tokens at *tokp into the stages of
+ *    a pipeline
  * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
+ * The arguments of all stages are stored in *argvp, each stage
+ * NULL-terminated, and (*cmdsp)[i].argv points to where stage i starts.
+ * Redirection tokens become the redirections of their stage. The job
+ * ends at a ';', a '&' or the end of the line; *tokp is left past the
+ * ';' or '&'. The arrays are allocated in the arena, so there is no
+ * limit on the number of arguments but the kernel's (ARG_MAX). Return
+ * true if the user has requested a BG job, false if the user has
+ * requested a FG job, and -1 (after saying why) if the job is
+ * malformed.
  */
-int parseline(const char *cmdline, char **argv) 
+int parseline(struct token_t **tokp, char ***argvp, struct cmd_t **cmdsp, int *ncmds) 
 {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
+    struct token_t *tok = *tokp;    /* ptr that traverses the tokens */
+    char **argv;                /* the arguments of all stages */
+    struct cmd_t *cmds;         /* the stages */
+    struct redir_t *redirs;     /* the redirections of all stages */
+    struct redir_t *r;
+    int ntoks;                  /* tokens in the job */
+    int argc;                   /* number of slots used in argv */
+    int start;                  /* slot where the current stage starts */
+    int nredirs, rstart;        /* same, for redirs */
     int bg;                     /* background job? */
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-	buf++;
+    /* Size everything for the worst case: each token an argument, a
+     * stage or a redirection */
+    for (ntoks = 0; tok[ntoks].type != TOK_END && tok[ntoks].type != TOK_SEMI &&
+		    tok[ntoks].type != TOK_AMP; ntoks++)
+	;
+    *argvp = argv = arena_alloc((2 * ntoks + 1) * sizeof(char *));
+    *cmdsp = cmds = arena_alloc((ntoks + 1) * sizeof(struct cmd_t));
+    redirs = arena_alloc((ntoks + 1) * sizeof(struct redir_t));
 
-    /* Build the argv list */
     argc = 0;
-    if (*buf == '\'') {
-	buf++;
-	delim = strchr(buf, '\'');
-    }
-    else {
-	delim = strchr(buf, ' ');
-    }
-
-    while (delim) {
-	argv[argc++] = buf;
-	*delim = '\0';
-	buf = delim + 1;
-	while (*buf && (*buf == ' ')) /* ignore spaces */
-	       buf++;
-
-	if (*buf == '\'') {
-	    buf++;
-	    delim = strchr(buf, '\'');
+    start = 0;
+    nredirs = 0;
+    rstart = 0;
+    bg = 0;
+    *ncmds = 0;
+    for (; tok->type != TOK_END; tok++) {
+	if (tok->type == TOK_SEMI || tok->type == TOK_AMP) {
+	    if (argc == 0 && nredirs == 0) {
+		printf("syntax error near '%c'\n", *tok->begin);
+		return -1;
+	    }
+	    bg = tok->type == TOK_AMP;
+	    tok++;
+	    break;
 	}
-	else {
-	    delim = strchr(buf, ' ');
+
+	switch (tok->type) {
+	case TOK_WORD:
+	    argv[argc++] = tok->text;
+	    break;
+	case TOK_PIPE:
+	    if (argc == start) {
+		printf("syntax error near '|'\n");
+		return -1;
+	    }
+	    argv[argc++] = NULL;
+	    cmds[*ncmds].argv = &argv[start];
+	    cmds[*ncmds].redirs = &redirs[rstart];
+	    cmds[(*ncmds)++].nredirs = nredirs - rstart;
+	    start = argc;
+	    rstart = nredirs;
+	    break;
+	case TOK_DUP:
+	    r = &redirs[nredirs++];
+	    r->fd = tok->fd;
+	    r->file = NULL;
+	    r->src = tok->src;
+	    break;
+	default:                /* TOK_IN, TOK_OUT or TOK_APPEND, then the file */
+	    if (tok[1].type != TOK_WORD) {
+		printf("syntax error near '%.*s'\n", (int)(tok->end - tok->begin), tok->begin);
+		return -1;
+	    }
+	    r = &redirs[nredirs++];
+	    r->fd = tok->fd;
+	    r->file = tok[1].text;
+	    r->src = -1;
+	    if (tok->type == TOK_IN)
+		r->flags = O_RDONLY;
+	    else if (tok->type == TOK_APPEND)
+		r->flags = O_WRONLY | O_CREAT | O_APPEND;
+	    else
+		r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+	    tok++;
 	}
     }
+    *tokp = tok;
+
+    if (argc > start) {
+	argv[argc++] = NULL;
+	cmds[*ncmds].argv = &argv[start];
+	cmds[*ncmds].redirs = &redirs[rstart];
+	cmds[(*ncmds)++].nredirs = nredirs - rstart;
+    }
+    else if (*ncmds > 0 || nredirs > rstart) {
+	printf("syntax error: missing command\n");
+	return -1;
+    }
     argv[argc] = NULL;
     
     if (argc == 0)  /* ignore blank line */
 	return 1;
 
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {  // 如果是bg，最后一个参数是去掉了&的
-	argv[--argc] = NULL;
-    }
     return bg;
 }
 
 
+/*
+ * passwd_lock - Open passwd for appending, holding the lock every
+ *    writer of it takes. Writers replace it by rename, so the file
+ *    locked must still be the one the path names.
+ */
+int passwd_lock(){
+    struct stat st;
+
+    while(1){
+        int fd = open(PASSWD_PATH, O_RDWR | O_APPEND | O_CLOEXEC);
+        if(fd < 0 || flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0){
+            unix_error(PASSWD_PATH);
+        }
+        if(st.st_nlink > 0){
+            return fd;
+        }
+        close(fd);  // replaced while we waited
+    }
+}
+
 void add_user(char ** argv){
-    if(strcmp(username, "root") != 0){
-        printf("root privileges required to run adduser.\n");
+    char password[MAXLINE];
+
+    if(strcmp(argv[1], "-f") == 0){
+        add_users(argv[2]);
         return;
     }
-    if(argv[1] == NULL  || argv[2] == NULL){
-        printf("need more arguments\n");
+    int fd = passwd_lock();
+    if(exist_user(argv[1], password)){
+        printf("User already exists\n");
+        close(fd);
+        return;
+    }
+    dprintf(fd, "%s:%s:/home/%s\n", argv[1], argv[2], argv[1]);
+    close(fd);
+
+    char path[MAXLINE + 20];
+    sprintf(path, "./home/%s", argv[1]); 
+
+    if(mkdir(path, 0777) != 0)
+        unix_error("mkdir error");
+
+    strcat(path, "/.tsh_history");
+    FILE * historyp = fopen(path, "w"); 
+    if(historyp == NULL){
+        unix_error("fopen");
+    }
+    fclose(historyp); 
+}
+
+/* make_homes - Thread of add_users: make the home directories of new users until none is left */
+void *make_homes(void *arg){
+    struct userbatch_t * b = arg;
+    char path[MAXLINE + 32];
+    size_t i;
+
+    while((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->n){
+        struct newuser_t * u = &b->users[i];
+        snprintf(path, sizeof(path), "./home/%s", u->name);
+        if(mkdir(path, 0777) != 0 && errno != EEXIST){
+            u->err = errno;
+            continue;
+        }
+        strcat(path, "/.tsh_history");
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);  // an old history stays
+        if(fd < 0){
+            u->err = errno;
+            continue;
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * add_users - adduser -f: add the users listed in file, one "name
+ *    password" a line. Names already in passwd or earlier in the file
+ *    are skipped. The home directories are made by a pool of threads,
+ *    then passwd is written once, with every user whose home could be
+ *    made, to a new file renamed over the old one.
+ */
+void add_users(char *file){
+    struct userbatch_t b = { 0 };
+    struct stat st;
+    const char * data;
+    uint32_t dlen;
+    size_t nlines = 0, cap = 16, skipped = 0, added = 0, at;
+    ssize_t n;
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) < 0){
+        printf("%s: %s\n", file, strerror(errno));
+        if(fd >= 0){
+            close(fd);
+        }
         return;
-    } else if(argv[3] != NULL){
+    }
+    char * list = malloc(st.st_size + 1);
+    if(list == NULL){
+        unix_error("malloc error");
+    }
+    for(at = 0; at < (size_t)st.st_size && (n = read(fd, list + at, st.st_size - at)) > 0; at += n)
+        ;
+    list[at] = '\0';
+    close(fd);
+    for(size_t i = 0; i < at; i++){
+        nlines += list[i] == '\n';
+    }
+    while(cap < (nlines + 1) * 2){
+        cap *= 2;
+    }
+    b.users = malloc((nlines + 1) * sizeof(struct newuser_t));
+    char ** seen = calloc(cap, sizeof(char *));     // the names taken so far
+    if(b.users == NULL || seen == NULL){
+        unix_error("malloc error");
+    }
+
+    int pwfd = passwd_lock();
+    passwd_open();
+    char * next;
+    int lineno = 0;
+    for(char * line = list; line != NULL; line = next){
+        lineno++;
+        if((next = strchr(line, '\n')) != NULL){
+            *next++ = '\0';
+        }
+        char * name = strtok(line, " \t"), * pass = strtok(NULL, " \t");
+        if(name == NULL || name[0] == '#'){
+            continue;
+        }
+        if(pass == NULL || strtok(NULL, " \t") != NULL || strpbrk(name, ":/") != NULL ||
+           strchr(pass, ':') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+           strlen(name) > MAXLINE / 2){
+            printf("%s: line %d: expected \"name password\"\n", file, lineno);
+            skipped++;
+            continue;
+        }
+        uint32_t h = cdb_hash(name, strlen(name)), slot;
+        for(slot = h & (cap - 1); seen[slot] != NULL && strcmp(seen[slot], name) != 0; slot = (slot + 1) & (cap - 1))
+            ;
+        if(seen[slot] != NULL || cdb_find(pwdb.map, pwdb.size, name, strlen(name), &data, &dlen)){
+            printf("%s: user already exists\n", name);
+            skipped++;
+            continue;
+        }
+        seen[slot] = name;
+        b.users[b.n].name = name;
+        b.users[b.n].pass = pass;
+        b.users[b.n++].err = 0;
+    }
+    free(seen);
+
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = nthreads < 1 ? 1 : nthreads > ADDUSER_THREADS ? ADDUSER_THREADS : nthreads;
+    if((size_t)nthreads > b.n){
+        nthreads = b.n;
+    }
+    pthread_t tids[ADDUSER_THREADS];
+    long started = 0;
+    for(; started < nthreads; started++){
+        if(pthread_create(&tids[started], NULL, make_homes, &b) != 0){
+            break;
+        }
+    }
+    if(started == 0){
+        make_homes(&b);
+    }
+    for(long t = 0; t < started; t++){
+        pthread_join(tids[t], NULL);
+    }
+
+    // the new passwd: the old one and a line for each user with a home
+    if(fstat(pwfd, &st) < 0){
+        unix_error(PASSWD_PATH);
+    }
+    size_t len = st.st_size, outcap = len + 1;
+    for(size_t i = 0; i < b.n; i++){
+        outcap += 2 * strlen(b.users[i].name) + strlen(b.users[i].pass) + 10;
+    }
+    char * out = malloc(outcap);
+    if(out == NULL){
+        unix_error("malloc error");
+    }
+    for(at = 0; at < len && (n = pread(pwfd, out + at, len - at, at)) > 0; at += n)
+        ;
+    len = at;
+    if(len > 0 && out[len - 1] != '\n'){
+        out[len++] = '\n';
+    }
+    for(size_t i = 0; i < b.n; i++){
+        struct newuser_t * u = &b.users[i];
+        if(u->err != 0){
+            printf("%s: cannot make home: %s\n", u->name, strerror(u->err));
+            skipped++;
+            continue;
+        }
+        len += sprintf(out + len, "%s:%s:/home/%s\n", u->name, u->pass, u->name);
+        added++;
+    }
+
+    char tmp[MAXLINE];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", PASSWD_PATH, getpid());
+    if(added > 0){
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+        if(fd < 0 || write(fd, out, len) != (ssize_t)len || close(fd) < 0 || rename(tmp, PASSWD_PATH) < 0){
+            printf("%s: %s\n", PASSWD_PATH, strerror(errno));
+            unlink(tmp);
+            added = 0;
+        }
+    }
+    close(pwfd);
+    printf("%zu users added, %zu skipped\n", added, skipped);
+    free(out);
+    free(b.users);
+    free(list);
+}
+
+/* history_prefix - The newest command of the history starting with pfx, as an off[] index; -1 if none */
+long history_prefix(const char *pfx, size_t plen){
+    size_t first = histlog.n - history_count(), len;
+    struct trigram_t * t;
+
+    if(plen == 0){
+        return -1;
+    }
+    trigram_build();
+    if((t = trigram_get(prefix_key(pfx, plen < 3 ? plen : 3), 0)) == NULL){
+        return -1;
+    }
+    for(uint32_t j = t->n; j-- > 0; ){
+        long i = t->ids[j] - histlog.idbase;
+        if(i < (long)first){
+            break;
+        }
+        char * s = history_entry(i, &len);
+        if(len >= plen && memcmp(s, pfx, plen) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * history_word - Find word n of the command s (n < 0: the last one),
+ *    splitting it as the lexer does on blanks outside quotes. Sets
+ *    *end to where the word ends. Returns where it starts, NULL if the
+ *    command has no such word.
+ */
+char * history_word(char *s, size_t len, int n, char **end){
+    char * p = s, * e = s + len, * word = NULL;
+
+    for(int w = 0; ; w++){
+        while(p < e && (*p == ' ' || *p == '\t'))
+            p++;
+        if(p == e){
+            break;
+        }
+        char * start = p, quote = 0;
+        for(; p < e && (quote || (*p != ' ' && *p != '\t')); p++){
+            if(*p == '\\' && quote != '\'' && p + 1 < e){
+                p++;
+            }else if(quote ? *p == quote : (*p == '\'' || *p == '"')){
+                quote = quote ? 0 : *p;
+            }
+        }
+        if(w == n || n < 0){
+            word = start;
+            *end = p;
+            if(w == n){
+                break;
+            }
+        }
+    }
+    return word;
+}
+
+/*
+ * expand_history - Replace the history references in cmdline: the
+ *    events !! (the last command), !n, !-n (the nth last), !prefix
+ *    and !?text? (the newest command starting with or holding it),
+ *    each optionally followed by :n, :$ or :* for word n, the last
+ *    word, or all the words after the first; and !$ and !* for !!:$
+ *    and !!:*. A '!' before a blank or the end of the line, or in
+ *    single quotes, is left alone. Returns cmdline if there are no
+ *    references, the expanded line (in the arena) if there were, NULL
+ *    if one could not be found.
+ */
+char * expand_history(char *cmdline){
+    char * out = NULL, * p, * q, * s, * end;
+    size_t cap = 0, len = 0, slen;
+    int expanded = 0;
+    char quote = 0;     // the quote we are in, as in history_word
+
+    for(p = cmdline; *p != '\0'; p = q){
+        q = p + 1;
+        if(*p == '\\' && quote != '\'' && p[1] != '\0'){
+            q = p + 2;
+        }else if(quote ? *p == quote : (*p == '\'' || *p == '"')){
+            quote = quote ? 0 : *p;
+        }
+        if(quote == '\'' || *p != '!' || strchr(" \t\n=(", p[1]) != NULL){
+            line_room(&out, &cap, len + (q - p));
+            memcpy(out + len, p, q - p);
+            len += q - p;
+            continue;
+        }
+
+        // the event
+        long i = -1;
+        size_t count = history_count();
+        char word = 0;  // '$', '*', or 'n' for word wordn
+        int wordn = 0;
+        if(*q == '!' || *q == '$' || *q == '*'){
+            i = count > 0 ? (long)(histlog.n - 1) : -1;
+            word = *q == '!' ? 0 : *q;
+            q++;
+        }else if(isdigit((unsigned char)*q) || (*q == '-' && isdigit((unsigned char)q[1]))){
+            long n = strtol(q, &q, 10);
+            n = n < 0 ? (long)count + n + 1 : n;
+            i = n >= 1 && n <= (long)count ? (long)(histlog.n - count) + n - 1 : -1;
+        }else if(*q == '?'){
+            size_t plen = strcspn(q + 1, "?\n");
+            size_t * hits = arena_alloc((count + 1) * sizeof(size_t));
+            if(history_search(q + 1, plen, hits) > 0){
+                i = hits[0];
+            }
+            q += 1 + plen + (q[1 + plen] == '?');
+        }else{
+            size_t plen = strcspn(q, " \t\n:;&|<>");
+            i = history_prefix(q, plen);
+            q += plen;
+        }
+        if(word == 0 && *q == ':' && (q[1] == '$' || q[1] == '*' || isdigit((unsigned char)q[1]))){
+            word = isdigit((unsigned char)q[1]) ? 'n' : q[1];
+            wordn = strtol(q + 1, &end, 10);
+            q = word == 'n' ? end : q + 2;
+        }
+        if(i < 0){
+            printf("%.*s: event not found\n", (int)(q - p), p);
+            free(out);
+            return NULL;
+        }
+
+        s = history_entry(i, &slen);
+        if(word == '$' || word == 'n'){
+            s = history_word(s, slen, word == '$' ? -1 : wordn, &end);
+        }else if(word == '*'){
+            if((s = history_word(s, slen, 1, &end)) != NULL){
+                end = history_entry(i, &slen) + slen;
+            }else{
+                s = end = "";   // no arguments: nothing
+            }
+        }else{
+            end = s + slen;
+        }
+        if(s == NULL){
+            printf("%.*s: bad word specifier\n", (int)(q - p), p);
+            free(out);
+            return NULL;
+        }
+        line_room(&out, &cap, len + (end - s));
+        memcpy(out + len, s, end - s);
+        len += end - s;
+        expanded = 1;
+    }
+    if(!expanded){
+        free(out);
+        return cmdline;
+    }
+
+    char * line = arena_alloc(len + 1);
+    memcpy(line, out, len);
+    line[len] = '\0';
+    free(out);
+    printf("%s", line);     // show what is run
+    return line;
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately.  
+ */
+int builtin_cmd(char **argv) 
+{
+    struct builtin_t * b;
+    int argc;
+
+    if((b = find_builtin(argv[0])) == NULL){
+        return 0;
+    }
+
+    if((b->flags & BI_ROOT) && strcmp(username, "root") != 0){
+        printf("root privileges required to run %s.\n", b->name);
+        return 1;
+    }
+    for(argc = 0; argv[argc + 1] != NULL; argc++)
+        ;
+    if(argc < b->minargs){
+        printf("need more arguments\n");
+    }else if(b->maxargs != BI_ANY && argc > b->maxargs){
         printf("too many arguments\n");
+    }else{
+        b->fn(argv);
+    }
+    return 1;
+}
+
+/* find_builtin - Return the builtin called name, NULL if there is none */
+struct builtin_t *find_builtin(char *name){
+    size_t len = strlen(name);
+    struct builtin_t * b;
+
+    if(len == 0){
+        return NULL;
+    }
+    b = &builtins[BUILTIN_HASH((unsigned char)name[0], (unsigned char)name[len - 1], len)];
+    if(b->name == NULL || strcmp(b->name, name) != 0){
+        return NULL;
+    }
+    return b;
+}
+
+void builtin_jobs(char **argv){
+    listjobs();
+}
+
+/*
+ * builtin_history - List the history; with -s, the commands holding a
+ *    pattern, newest first; with -w, write the log out compacted now
+ *    (which also turns a plain log into one with references).
+ */
+void builtin_history(char **argv){
+    if(argv[1] == NULL){
+        list_history();
+        return;
+    }
+    if(strcmp(argv[1], "-w") == 0 && argv[2] == NULL){
+        compact_history(1);
+        return;
+    }
+    if(strcmp(argv[1], "-s") != 0 || argv[2] == NULL || argv[3] != NULL){
+        printf("usage: history [-w | -s pattern]\n");
         return;
     }
 
-    char password[MAXLINE];
-    if(exist_user(argv[1], password)){
-        printf("User already exists\n");
+    size_t count = history_count(), len;
+    size_t * hits = arena_alloc((count + 1) * sizeof(size_t));
+    size_t nhits = history_search(argv[2], strlen(argv[2]), hits);
+    for(size_t j = 0; j < nhits; j++){
+        char * cmd = history_entry(hits[j], &len);
+        printf("%zu %.*s\n", hits[j] - (histlog.n - count) + 1, (int)len, cmd);
+    }
+}
+
+void builtin_logout(char **argv){
+    if(check_suspend()){
+        printf("There are suspended jobs.\n");
+    }else{
+        do_quit();
+    }
+}
+
+void builtin_quit(char **argv){
+    do_quit();
+}
+
+/* ru_add - Add the usage in from to to; maxrss is the larger of the two */
+void ru_add(struct rusage *to, const struct rusage *from){
+    timeradd(&to->ru_utime, &from->ru_utime, &to->ru_utime);
+    timeradd(&to->ru_stime, &from->ru_stime, &to->ru_stime);
+    if(from->ru_maxrss > to->ru_maxrss){
+        to->ru_maxrss = from->ru_maxrss;
+    }
+    to->ru_minflt += from->ru_minflt;
+    to->ru_majflt += from->ru_majflt;
+    to->ru_nvcsw += from->ru_nvcsw;
+    to->ru_nivcsw += from->ru_nivcsw;
+}
+
+/*
+ * sample_proc - Read the user and system time and the resident size of
+ *    a live process from the kernel's /proc/<pid>/stat: one small read,
+ *    and the fields are found by counting from the end of the name.
+ *    Returns 0 if the process is gone.
+ */
+int sample_proc(pid_t pid, double *user, double *sys, long *rsskb){
+    static long tick, pagekb;
+    char path[64], buf[512];
+    unsigned long ut, st;
+    long rss;
+    ssize_t n;
+    int fd;
+
+    if(tick == 0){
+        tick = sysconf(_SC_CLK_TCK);
+        pagekb = sysconf(_SC_PAGESIZE) / 1024;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0){
+        return 0;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0){
+        return 0;
+    }
+    buf[n] = '\0';
+
+    char * p = strrchr(buf, ')');   // the name may hold spaces and parentheses
+    if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+                           "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &ut, &st, &rss) != 3){
+        return 0;
+    }
+    *user = (double)ut / tick;
+    *sys = (double)st / tick;
+    *rsskb = rss * pagekb;
+    return 1;
+}
+
+struct psrow_t {            /* One line of ps */
+    int jid;
+    pid_t pid;
+    char *state;
+    double user, sys;       /* seconds of CPU time */
+    long rss;               /* KB: the peak once done, the current size while running */
+    long csw;               /* context switches, -1 while some of it runs */
+    double wall;            /* seconds since it started */
+    char *cmdline;
+};
+
+static int ps_by_mem;       /* sort ps by rss instead of CPU time */
+
+static int ps_cmp(const void *a, const void *b){
+    const struct psrow_t *x = a, *y = b;
+
+    if(ps_by_mem){
+        return (y->rss > x->rss) - (y->rss < x->rss);
+    }
+    return (y->user + y->sys > x->user + x->sys) - (y->user + y->sys < x->user + x->sys);
+}
+
+/*
+ * builtin_ps - Show the resource usage of the jobs in the job list and
+ *    of the last PS_DONE finished ones, by CPU time (-c, the default)
+ *    or by memory (-m). Finished processes are counted from what wait4
+ *    returned; the live ones of a job are sampled from /proc/<pid>/stat.
+ */
+void builtin_ps(char **argv){
+    struct timespec now;
+    int n = 0;
+
+    if(argv[1] != NULL && strcmp(argv[1], "-c") != 0 && strcmp(argv[1], "-m") != 0){
+        printf("usage: ps [-c | -m]\n");
         return;
     }
+    ps_by_mem = argv[1] != NULL && strcmp(argv[1], "-m") == 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    FILE * fp = fopen("./etc/passwd", "a");
-    if(fp == NULL){
-        unix_error("fopen");
+    struct psrow_t * rows = arena_alloc((nrunning + nstopped + PS_DONE) * sizeof(struct psrow_t));
+    for(int i = 1; i <= topjid; i++){
+        struct job_t * job = &jobs[i];
+        long live = 0;
+
+        if(job->pid == 0){
+            continue;
+        }
+        struct psrow_t * r = &rows[n++];
+        r->jid = job->jid;
+        r->pid = job->pid;
+        r->state = job->state == ST ? "Stopped" : "Running";
+        r->user = job->ru.ru_utime.tv_sec + job->ru.ru_utime.tv_usec / 1e6;
+        r->sys = job->ru.ru_stime.tv_sec + job->ru.ru_stime.tv_usec / 1e6;
+        r->csw = job->ru.ru_nvcsw + job->ru.ru_nivcsw;
+        for(int j = 0; j < job->npids; j++){
+            double user, sys;
+            long rss;
+            if(job->pids[j] != 0 && sample_proc(job->pids[j], &user, &sys, &rss)){
+                r->user += user;
+                r->sys += sys;
+                live += rss;
+                r->csw = -1;
+            }
+        }
+        r->rss = live > job->ru.ru_maxrss ? live : job->ru.ru_maxrss;
+        r->wall = (now.tv_sec - job->start.tv_sec) + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+        r->cmdline = job->cmdline;
     }
-    fprintf(fp, "%s:%s:/home/%s\n", argv[1], argv[2], argv[1]);
-    fclose(fp);
+    for(unsigned long k = ndone; k > 0 && k + PS_DONE > ndone; k--){
+        struct donejob_t * d = &donejobs[(k - 1) % PS_DONE];
+        struct psrow_t * r = &rows[n++];
+
+        r->jid = d->jid;
+        r->pid = d->pid;
+        r->state = "Done";
+        r->user = d->ru.ru_utime.tv_sec + d->ru.ru_utime.tv_usec / 1e6;
+        r->sys = d->ru.ru_stime.tv_sec + d->ru.ru_stime.tv_usec / 1e6;
+        r->rss = d->ru.ru_maxrss;
+        r->csw = d->ru.ru_nvcsw + d->ru.ru_nivcsw;
+        r->wall = d->wall;
+        r->cmdline = d->cmdline;
+    }
+    qsort(rows, n, sizeof(struct psrow_t), ps_cmp);
+
+    printf("%5s %7s %-7s %8s %8s %9s %7s %9s %s\n",
+           "JID", "PGID", "STAT", "USER", "SYS", "RSS(KB)", "CSW", "ELAPSED", "CMD");
+    for(int i = 0; i < n; i++){
+        struct psrow_t * r = &rows[i];
+        char csw[24] = "-";
+        if(r->csw >= 0){
+            snprintf(csw, sizeof(csw), "%ld", r->csw);
+        }
+        printf("%5d %7d %-7s %8.2f %8.2f %9ld %7s %9.2f %s",
+               r->jid, r->pid, r->state, r->user, r->sys, r->rss, csw, r->wall, r->cmdline);
+    }
+}
 
-    char path[MAXLINE + 20];
-    sprintf(path, "./home/%s", argv[1]); 
+/* now_ns - The monotonic clock in nanoseconds */
+uint64_t now_ns(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The latency histograms are log-linear: values below 1<<HIST_SUB_BITS
+ * have a slot each, and every power of 2 above that is cut into
+ * 1<<HIST_SUB_BITS equal slots, so a value is recorded with at most
+ * 1/16 relative error in a fixed table, whatever its range. Adding a
+ * sample is a couple of shifts and an increment.
+ */
 
-    if(mkdir(path, 0777) != 0)
-        unix_error("mkdir error");
+/* hist_add - Record a sample of ns nanoseconds */
+void hist_add(struct hist_t *h, uint64_t ns){
+    int slot = ns;
 
-    strcat(path, "/.tsh_history");
-    FILE * historyp = fopen(path, "w"); 
-    if(historyp == NULL){
-        unix_error("fopen");
+    if(ns >= (1 << HIST_SUB_BITS)){
+        int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+        slot = ((shift + 1) << HIST_SUB_BITS) + ((ns >> shift) & ((1 << HIST_SUB_BITS) - 1));
     }
-    fclose(historyp); 
+    h->slots[slot]++;
+    if(h->count == 0 || ns < h->min){
+        h->min = ns;
+    }
+    if(ns > h->max){
+        h->max = ns;
+    }
+    h->count++;
+    h->sum += ns;
 }
 
-void nth_cmd(char ** argv){
-    char nstr[MAXLINE];
-    int i;
-    for(i = 1 ; argv[0][i] != '\0'; i++){
-        nstr[i-1] = argv[0][i];
+/* hist_value - The smallest value recorded in slot */
+uint64_t hist_value(int slot){
+    int shift = (slot >> HIST_SUB_BITS) - 1;
+
+    if(shift < 0){
+        return slot;
     }
-    nstr[i-1] = '\0';
+    return (uint64_t)((1 << HIST_SUB_BITS) + (slot & ((1 << HIST_SUB_BITS) - 1))) << shift;
+}
 
-    int n = atoi(nstr);
-    if(n > MAXHISTORY){
-        printf("only support the last %d commands\n", MAXHISTORY);
-        return;
+/* hist_percentile - The value below which a fraction p of the samples fall */
+uint64_t hist_percentile(struct hist_t *h, double p){
+    uint64_t want = p * h->count, seen = 0;
+
+    for(int i = 0; i < HIST_SLOTS; i++){
+        seen += h->slots[i];
+        if(seen > want){
+            uint64_t v = hist_value(i);
+            return v < h->min ? h->min : v > h->max ? h->max : v;
+        }
     }
+    return h->max;
+}
 
-    char * cmdline = nth_history(n);
+/* print_time - Report a timed job the way other shells do */
+void print_time(uint64_t ns, struct rusage *ru){
+    double real = ns / 1e9, user = 0, sys = 0;
 
-    if(cmdline[0] == '\0'){
-        printf("no %dth command yet\n", n);
-        return;
+    if(ru != NULL){
+        user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+        sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
     }
-    eval(cmdline);
+    printf("\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+           (int)(real / 60), real - (int)(real / 60) * 60,
+           (int)(user / 60), user - (int)(user / 60) * 60,
+           (int)(sys / 60), sys - (int)(sys / 60) * 60);
 }
 
-/* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+/* print_self_time - Report a timed builtin: it ran in the shell, so its usage is the shell's since self */
+void print_self_time(uint64_t ns, struct rusage *self){
+    struct rusage now;
+
+    getrusage(RUSAGE_SELF, &now);
+    timersub(&now.ru_utime, &self->ru_utime, &now.ru_utime);
+    timersub(&now.ru_stime, &self->ru_stime, &now.ru_stime);
+    print_time(ns, &now);
+}
+
+/*
+ * job_rusage - The usage of the job in group pgid: what is counted so
+ *    far if it is still in the job list (stopped), else what it had
+ *    when it was deleted. NULL if it is in neither.
  */
-int builtin_cmd(char **argv) 
-{
-    //判断是否为builtin 
-    if(strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0 ){
-        do_bgfg(argv);
-       
-    }else if(strcmp(argv[0], "jobs") == 0){
-        if(argv[1] == NULL)
-            listjobs(jobs);
-        else
-            printf("too many arguments\n");
-    }else if(strcmp(argv[0], "adduser") == 0){ 
-        add_user(argv);
-    }else if (strcmp(argv[0], "history") == 0){
-        if(argv[1] != NULL){
-            printf("too many arguments\n");   
+struct rusage *job_rusage(pid_t pgid){
+    struct job_t * job = getjobpid(pgid);
+
+    if(job != NULL){
+        return &job->ru;
+    }
+    for(unsigned long k = ndone; k > 0 && k + PS_DONE > ndone; k--){
+        if(donejobs[(k - 1) % PS_DONE].pid == pgid){
+            return &donejobs[(k - 1) % PS_DONE].ru;
         }
-        list_history();
-    }else if (argv[0][0] == '!'){
-        nth_cmd(argv);
-    }else if (strcmp(argv[0], "logout") == 0){
-        if(check_suspend()){
-            printf("There are suspended jobs.\n");
-        }else{
-            do_quit();
+    }
+    return NULL;
+}
+
+/*
+ * builtin_time - time on its own; with a command, eval_job takes the
+ *    prefix off and reports the job's real, user and system time.
+ */
+void builtin_time(char **argv){
+    printf("usage: time command [args...]\n");
+}
+
+/*
+ * builtin_stats - Show the latency histograms, in microseconds, or
+ *    with -r, clear them. Parsing is per command line, spawning is from
+ *    the first fork to the last process started, and foreground is
+ *    from there to the shell taking the prompt back.
+ */
+void builtin_stats(char **argv){
+    struct hist_t * hists[] = { &hist_parse, &hist_spawn, &hist_fg };
+
+    if(argv[1] != NULL && strcmp(argv[1], "-r") != 0){
+        printf("usage: stats [-r]\n");
+        return;
+    }
+    if(argv[1] != NULL){
+        for(int i = 0; i < 3; i++){
+            char * name = hists[i]->name;
+            memset(hists[i], 0, sizeof(struct hist_t));
+            hists[i]->name = name;
         }
-    }else if(strcmp(argv[0], "quit") == 0){
-        do_quit();
-    }else{
-        return 0;
+        return;
     }
 
-    return 1;
+    printf("%-10s %8s %10s %10s %10s %10s %10s %10s\n",
+           "(us)", "COUNT", "MIN", "P50", "P90", "P99", "MAX", "MEAN");
+    for(int i = 0; i < 3; i++){
+        struct hist_t * h = hists[i];
+        if(h->count == 0){
+            printf("%-10s %8d\n", h->name, 0);
+            continue;
+        }
+        printf("%-10s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", h->name, (unsigned long)h->count,
+               h->min / 1e3, hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+               hist_percentile(h, 0.99) / 1e3, h->max / 1e3, (double)h->sum / h->count / 1e3);
+    }
 }
 
-pid_t check_suspend(){
-    int i;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].state == ST)
-            return jobs[i].pid;
-    return 0;
+/* check_suspend - Return the number of stopped jobs */
+int check_suspend(){
+    return nstopped;
 }
 
-pid_t check_run(){
-    int i;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].state == FG || jobs[i].state == BG )
-            return jobs[i].pid;
-    return 0;
+/* check_run - Return the number of running jobs */
+int check_run(){
+    return nrunning;
 }
 
 void do_quit(){
-    save_history();
+    compact_history(0);
     free(username);
-    for(int i = 0; i < MAXJOBS; i++){
+    for(int i = 1; i <= topjid; i++){
 	    if (jobs[i].state == BG || jobs[i].state == FG){
             kill(-jobs[i].pid, SIGINT);
         }
     }
 
-    sigset_t mask, prev;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
-    sigprocmask(SIG_BLOCK, &mask, &prev);
-
-    pid_t p = check_run();
-    
-    while(p != 0){
-        sigsuspend(&prev);
-        p = check_run();
+    while(check_run() != 0){
+        wait_events(sigepfd);
     }
-    sigprocmask(SIG_SETMASK, &prev, NULL);
 
-    for(int i = 0; i < MAXJOBS; i++){
+    for(int i = 1; i <= topjid; i++){
 	    if (jobs[i].state == ST){
-            remove_proc(jobs[i].pid);
+            for(int j = 0; j < jobs[i].npids; j++){
+                if(jobs[i].pids[j] != 0){
+                    remove_proc(jobs[i].pids[j]);
+                }
+            }
         }
     }
 
     remove_proc(shell_pid);
+    flush_procs();
     exit(0);
 }
 
@@ -666,10 +4539,10 @@ struct job_t * pidjid_str2job(char * str){
         }
         jid_str[i] = '\0';
         int jid = atoi(jid_str);
-        return getjobjid(jobs, jid);
+        return getjobjid(jid);
     }else{
         pid_t pid = atoi(str);  // 参数为char *，  返回值为int 转换为pid_t行不行  测一下。。。
-        return getjobpid(jobs, pid);
+        return getjobpid(pid);
     }
 
 }
@@ -679,17 +4552,6 @@ struct job_t * pidjid_str2job(char * str){
  */
 void do_bgfg(char **argv) 
 {
-    if(argv[1] == NULL){
-        printf("need more arguments\n");
-        return;
-    }else if(argv[2] != NULL){
-        printf("too many arguments\n");
-        return;
-    }
-
-    sigset_t mask_all, prev;
-    sigfillset(&mask_all);
-
     struct job_t * job = pidjid_str2job(argv[1]);
     if(job == NULL || job->state == UNDEF){
         printf("no such job or process\n");
@@ -697,23 +4559,23 @@ void do_bgfg(char **argv)
     }
 
     if(strcmp(argv[0], "fg") == 0){
-        change_proc_stat(job->pid, "R+");
+        change_job_stat(job, "R+");
         change_proc_stat(shell_pid, "Ss");
 
         if(job->state == ST){  // ST -> FG
             kill(-job->pid, SIGCONT);
         }
-        job->state = FG;  // ST -> FG, BG -> FG
+        setjobstate(job, FG);  // ST -> FG, BG -> FG
 
         waitfg(job->pid);
         change_proc_stat(shell_pid, "Rs+");
 
     }else if(strcmp(argv[0], "bg") == 0){  // ST -> BG, BG -> BG
-        change_proc_stat(job->pid, "R");
+        change_job_stat(job, "R");
         if(job -> state != BG){
             kill(-job->pid, SIGCONT);
         }
-        job->state = BG;
+        setjobstate(job, BG);
     }
 
     return;
@@ -722,69 +4584,396 @@ void do_bgfg(char **argv)
 
 /* 
  * waitfg - Block until process pid is no longer the foreground process
+ *
+ * Only sigfd is waited on, so typed-ahead input doesn't wake us: each
+ * wakeup is a batch of signals, and the job is looked at once per batch.
  */
 void waitfg(pid_t pid)
 {
-    sigset_t mask_all, prev;
-    sigfillset(&mask_all);
-    sigprocmask(SIG_BLOCK, &mask_all, &prev);
-
-    struct job_t * job = getjobpid(jobs, pid);
+    struct job_t * job = getjobpid(pid);
     while(job != NULL && job -> state == FG){
-        sigsuspend(&prev);
+        wait_events(sigepfd);
     }
-    sigprocmask(SIG_SETMASK, &prev, NULL);
 
     return;
 }
 
-void remove_proc(pid_t pid){
-    char path[MAXLINE];
-    sprintf(path, "./proc/%d/status", pid);
-    if(remove(path) != 0){
-        unix_error("remove error");
+/*************
+ * Event loop
+ *************/
+
+/*
+ * init_events - Block the signals the shell handles and have them
+ *    delivered through sigfd instead. The handlers below then run from
+ *    the main loop, never asynchronously, so the job list, stdio and
+ *    the ./proc files need no protection against them.
+ */
+void init_events(){
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    sigemptyset(&shell_sigs);
+    sigaddset(&shell_sigs, SIGINT);     /* ctrl-c */
+    sigaddset(&shell_sigs, SIGTSTP);    /* ctrl-z */
+    sigaddset(&shell_sigs, SIGCHLD);    /* Terminated or stopped child */
+    sigaddset(&shell_sigs, SIGQUIT);    /* a clean way to kill the shell */
+    if(sigprocmask(SIG_BLOCK, &shell_sigs, &child_mask) < 0){
+        unix_error("sigprocmask error");
     }
 
-    sprintf(path, "./proc/%d", pid);
-    if(rmdir(path) != 0){ // remove directory only if it's empty
-        unix_error("rmdir error");
+    if((sigfd = signalfd(-1, &shell_sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0){
+        unix_error("signalfd error");
+    }
+    if((sigepfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+       (inepfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        unix_error("epoll_create1 error");
+    }
+    ev.data.fd = sigfd;
+    if(epoll_ctl(sigepfd, EPOLL_CTL_ADD, sigfd, &ev) < 0 ||
+       epoll_ctl(inepfd, EPOLL_CTL_ADD, sigfd, &ev) < 0){
+        unix_error("epoll_ctl error");
+    }
+    ev.data.fd = STDIN_FILENO;
+    if(epoll_ctl(inepfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0){
+        close(inepfd);  // a regular file: reads never block anyway
+        inepfd = -1;
+    }
+}
+
+/*
+ * dispatch_signals - Run the handler of every signal waiting on sigfd.
+ *    A burst of child exits is one SIGCHLD here, and one waitpid loop.
+ */
+void dispatch_signals(){
+    struct signalfd_siginfo si[SIGBATCH];
+    int chld = 0, intr = 0, tstp = 0, quit = 0;
+    ssize_t n;
+
+    while((n = read(sigfd, si, sizeof(si))) > 0){
+        for(int i = 0; i < n / (ssize_t)sizeof(si[0]); i++){
+            switch(si[i].ssi_signo){
+            case SIGCHLD: chld = 1; break;
+            case SIGINT:  intr = 1; break;
+            case SIGTSTP: tstp = 1; break;
+            case SIGQUIT: quit = 1; break;
+            }
+        }
+    }
+    if(n < 0 && errno != EAGAIN && errno != EINTR){
+        unix_error("signalfd read error");
+    }
+
+    if(quit)
+        sigquit_handler(SIGQUIT);
+    if(intr)
+        sigint_handler(SIGINT);
+    if(tstp)
+        sigtstp_handler(SIGTSTP);
+    if(chld)
+        sigchld_handler(SIGCHLD);
+}
+
+/*
+ * wait_events - Sleep on epfd (sigepfd or inepfd) until something is
+ *    ready, and dispatch any signals. Returns 1 if stdin is readable.
+ *    Pending process records are written out first if nothing happens
+ *    within PROC_FLUSH_MS.
+ */
+int wait_events(int epfd){
+    struct epoll_event ev[2];
+    int n, input = 0;
+
+    // a short wait leaves the pending records for the end of the line
+    n = ndirty > 0 ? epoll_wait(epfd, ev, 2, PROC_FLUSH_MS) : 0;
+    if(n == 0){
+        flush_procs();
+        compact_history(0);
+        n = epoll_wait(epfd, ev, 2, -1);
+    }
+    if(n < 0){
+        if(errno == EINTR){
+            return 0;
+        }
+        unix_error("epoll_wait error");
+    }
+    for(int i = 0; i < n; i++){
+        if(ev[i].data.fd == sigfd){
+            dispatch_signals();
+        }else if(ev[i].data.fd == histlog.ifd){
+            history_events();
+        }else{
+            input = 1;
+        }
+    }
+    return input;
+}
+
+/*
+ * read_line - Like getline on stdin, except that while no line is
+ *    ready the shell goes on reaping and handling signals. Returns the
+ *    length of the line, or -1 at the end of the input.
+ */
+ssize_t read_line(char **lineptr, size_t *cap){
+    char *nl;
+    size_t len;
+
+    while(1){
+        nl = memchr(inbuf.buf + inbuf.start, '\n', inbuf.end - inbuf.start);
+        if(nl != NULL || (inbuf.eof && inbuf.end > inbuf.start)){
+            len = (nl != NULL ? nl + 1 - inbuf.buf : inbuf.end) - inbuf.start;
+            if(len + 1 > *cap){
+                *cap = len + 1;
+                if((*lineptr = realloc(*lineptr, *cap)) == NULL){
+                    unix_error("realloc error");
+                }
+            }
+            memcpy(*lineptr, inbuf.buf + inbuf.start, len);
+            (*lineptr)[len] = '\0';
+            inbuf.start += len;
+            return len;
+        }
+        if(inbuf.eof){
+            return -1;
+        }
+        fill_inbuf();
+    }
+}
+
+/*
+ * fill_inbuf - Wait until stdin can be read, reaping and handling
+ *    signals meanwhile, and read what there is into inbuf.
+ */
+void fill_inbuf(){
+    ssize_t n;
+
+    if(inepfd >= 0){
+        while(!wait_events(inepfd))
+            ;
+    }else{
+        flush_procs();
+        dispatch_signals();
+    }
+
+    if(inbuf.start > 0){    // keep the partial line at the front
+        memmove(inbuf.buf, inbuf.buf + inbuf.start, inbuf.end - inbuf.start);
+        inbuf.end -= inbuf.start;
+        inbuf.start = 0;
+    }
+    if(inbuf.end == inbuf.cap){
+        inbuf.cap = inbuf.cap ? inbuf.cap * 2 : INBUF_SIZE;
+        if((inbuf.buf = realloc(inbuf.buf, inbuf.cap)) == NULL){
+            unix_error("realloc error");
+        }
+    }
+    if((n = read(STDIN_FILENO, inbuf.buf + inbuf.end, inbuf.cap - inbuf.end)) < 0){
+        if(errno == EINTR || errno == EAGAIN){
+            return;
+        }
+        unix_error("read error");
+    }
+    if(n == 0){
+        inbuf.eof = 1;
+    }
+    inbuf.end += n;
+}
+
+/* read_key - The next byte typed, -1 at the end of the input */
+int read_key(){
+    while(inbuf.start == inbuf.end){
+        if(inbuf.eof){
+            return -1;
+        }
+        fill_inbuf();
+    }
+    return (unsigned char)inbuf.buf[inbuf.start++];
+}
+
+/* line_room - Make room in *lineptr for a line of len bytes and "\n\0" */
+void line_room(char **lineptr, size_t *cap, size_t len){
+    if(len + 2 > *cap){
+        *cap = len + 2 > 2 * *cap ? len + 2 : 2 * *cap;
+        if((*lineptr = realloc(*lineptr, *cap)) == NULL){
+            unix_error("realloc error");
+        }
+    }
+}
+
+/* line_set - Make *lineptr the len bytes at s (not in *lineptr) */
+void line_set(char **lineptr, size_t *cap, const char *s, size_t len){
+    line_room(lineptr, cap, len);
+    memcpy(*lineptr, s, len);
+}
+
+/* skip_escape - Drop the rest of an escape sequence (arrow keys and such) */
+void skip_escape(){
+    int c = read_key();
+
+    if(c == '[' || c == 'O'){
+        while((c = read_key()) >= 0 && (c < 0x40 || c > 0x7e))
+            ;
+    }
+}
+
+/*
+ * reverse_search - ctrl-r: show the newest command holding what is
+ *    typed, and the one before it on every ctrl-r. Enter runs it,
+ *    ctrl-g gives the line back, and any other key stops the search
+ *    and leaves the command to be edited. Returns 1 to run the line.
+ */
+int reverse_search(char **lineptr, size_t *cap, size_t *len){
+    char pat[MAXLINE];
+    size_t plen = 0, nhits = 0, at = 0, mlen = 0;
+    size_t * hits = malloc((history_count() + 1) * sizeof(size_t));
+    char * saved = malloc(*len + 1), * match = "";
+    int c, run = 0;
+
+    if(hits == NULL || saved == NULL){
+        unix_error("malloc error");
+    }
+    memcpy(saved, *lineptr, *len);
+    while(1){
+        printf("\r\33[K(%sreverse-i-search)`%.*s': %.*s",
+               plen > 0 && nhits == 0 ? "failed " : "", (int)plen, pat, (int)mlen, match);
+        fflush(stdout);
+
+        c = read_key();
+        if(c == 18){            // ctrl-r: the one before
+            if(at + 1 < nhits){
+                at++;
+            }
+        }else if(c == 127 || c == 8){
+            if(plen > 0){
+                plen--;
+            }
+            nhits = history_search(pat, plen, hits);
+            at = 0;
+        }else if(c >= 32 && c < 127 && plen < sizeof(pat)){
+            pat[plen++] = c;
+            nhits = history_search(pat, plen, hits);
+            at = 0;
+        }else{
+            if(c == 27){
+                skip_escape();
+            }
+            break;
+        }
+        if(nhits > 0){
+            match = history_entry(hits[at], &mlen);
+        }
     }
 
+    if(c == 7){                 // ctrl-g
+        line_set(lineptr, cap, saved, *len);
+    }else{
+        line_set(lineptr, cap, match, mlen);
+        *len = mlen;
+        run = c == '\n' || c == '\r' || c < 0;
+    }
+    printf("\r\33[K%s%.*s", prompt, (int)*len, *lineptr);
+    free(hits);
+    free(saved);
+    return run;
 }
 
+/*
+ * edit_line - read_line for a terminal. The terminal is taken out of
+ *    canonical mode while the line is typed, so that the shell sees
+ *    ctrl-r. Besides it, backspace and ctrl-u (erase the line) are
+ *    understood, and ctrl-d on an empty line ends the input.
+ */
+ssize_t edit_line(char **lineptr, size_t *cap){
+    struct termios raw = tty_mode;
+    size_t len = 0;
+    int c;
+
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    line_room(lineptr, cap, 0);
+    while(1){
+        c = read_key();
+        if(c < 0 || (c == 4 && len == 0)){
+            tcsetattr(STDIN_FILENO, TCSANOW, &tty_mode);
+            return -1;
+        }
+        if(c == '\n' || c == '\r' || (c == 18 && reverse_search(lineptr, cap, &len))){
+            break;
+        }
+        if(c == 127 || c == 8){
+            if(len > 0){
+                len--;
+                printf("\b \b");
+            }
+        }else if(c == 21){      // ctrl-u
+            for(; len > 0; len--){
+                printf("\b \b");
+            }
+        }else if(c == 27){
+            skip_escape();
+        }else if(c >= 32 || c == '\t'){
+            line_room(lineptr, cap, len + 1);
+            (*lineptr)[len++] = c;
+            putchar(c);
+        }
+        fflush(stdout);
+    }
+    tcsetattr(STDIN_FILENO, TCSANOW, &tty_mode);
+    putchar('\n');
+    (*lineptr)[len] = '\n';
+    (*lineptr)[len + 1] = '\0';
+    return len + 1;
+}
 
 /*****************
  * Signal handlers
  *****************/
 
-/* 
+/*
+ * The handlers are not installed with sigaction: the signals stay
+ * blocked and dispatch_signals calls these from the main loop.
+ */
+
+/*
  * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
  *     a child job terminates (becomes a zombie), or stops because it
  *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
  *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+ *     currently running children to terminate. The resource usage of
+ *     each is added to its job's, for ps.
  */
-void sigchld_handler(int sig) 
+void sigchld_handler(int sig)
 {
-    int olderrno = errno;
-    sigset_t mask_all, prev_all;
     pid_t pid;
     int status;
+    struct rusage ru;
 
-    sigfillset(&mask_all);
-    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
-
-    while((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0){
+    while((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0){
 
-        struct job_t * job = getjobpid(jobs, pid);
+        struct job_t * job = getjobpid(pid);
+        if(job == NULL){
+            continue;
+        }
         if(WIFSTOPPED(status)){
-            job -> state = ST;
-        } else if(WIFSIGNALED(status)){
-            int signal_num = WTERMSIG(status);
-            printf("process %d terminated due to uncaught signal %d: %s\n", job->pid, signal_num, strsignal(signal_num));
-            deletejob(jobs, pid);
+            if(job->state != ST){
+                setjobstate(job, ST);
+            }
         } else{
-            deletejob(jobs, pid);
+            if(WIFSIGNALED(status)){
+                int signal_num = WTERMSIG(status);
+                printf("process %d terminated due to uncaught signal %d: %s\n", pid, signal_num, strsignal(signal_num));
+            }
+            for(int i = 0; i < job->npids; i++){
+                if(job->pids[i] == pid){
+                    job->pids[i] = 0;
+                }
+            }
+            ru_add(&job->ru, &ru);
+            if(pid != job->pid){  // the leader stays findable until the job goes
+                pidhash_del(pid);
+            }
+            if(--job->nlive == 0){  // the last process of the job is gone
+                deletejob(job->pid);
+            }
         }
 
 
@@ -795,56 +4984,35 @@ void sigchld_handler(int sig)
         }
 
     }
-    sigprocmask(SIG_SETMASK, &prev_all, NULL);
-
-    errno = olderrno;
     return;
 }
 
-/* 
+/*
  * sigint_handler - The kernel sends a SIGINT to the shell whenver the
  *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+ *    to the foreground job.
  */
-void sigint_handler(int sig) 
+void sigint_handler(int sig)
 {
-    int olderrno = errno;
-
-    sigset_t mask_all, prev;
-    sigfillset(&mask_all);
-    sigprocmask(SIG_BLOCK, &mask_all, &prev);
-
-    pid_t fg_pid = fgpid(jobs);
+    pid_t fg_pid = fgpid();
 
     if(fg_pid != 0)
         kill(-fg_pid, SIGINT);
-    
-    sigprocmask(SIG_SETMASK, &prev, NULL);  // unblock
-    
-    errno = olderrno;
+
     return;
 }
 
 /*
  * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
  *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ *     foreground job by sending it a SIGTSTP.
  */
-void sigtstp_handler(int sig) 
+void sigtstp_handler(int sig)
 {
-    int olderrno = errno;
-
-    sigset_t mask_all, prev;
-    sigfillset(&mask_all);
-    sigprocmask(SIG_BLOCK, &mask_all, &prev);
-
-    pid_t fg_pid = fgpid(jobs);
+    pid_t fg_pid = fgpid();
     if(fg_pid != 0)
         kill(-fg_pid, SIGTSTP);
 
-    sigprocmask(SIG_SETMASK, &prev, NULL);  // unblock
-   
-    errno = olderrno;
     return;
 }
 
@@ -859,143 +5027,306 @@ void sigtstp_handler(int sig)
 /* clearjob - Clear the entries in a job struct */
 void clearjob(struct job_t *job) {
     job->pid = 0;
+    job->npids = 0;
+    job->nlive = 0;
     job->jid = 0;
     job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    memset(&job->ru, 0, sizeof(job->ru));
+    if (job->cmdline != NULL)   /* buffers are kept for the next job */
+        job->cmdline[0] = '\0';
 }
 
+/*
+ * The job list is indexed by jid, so a job is found by its jid
+ * directly, and by the pid of any of its processes through pidhash.
+ * jidmap marks the jids in use. The table only ever grows, and only
+ * from addjob.
+ */
+
 /* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
+void initjobs() {
+    growjobs(JOBS_INIT);
+    jidmap[0] = 1;      /* jid 0 is never handed out */
+    pidhash_reserve(JOBS_INIT);
+}
+
+/* growjobs - Make room in the job list for jids up to cap-1 */
+void growjobs(int cap) {
     int i;
 
-    for (i = 0; i < MAXJOBS; i++)
-	    clearjob(&jobs[i]);
+    jobs = realloc(jobs, cap * sizeof(struct job_t));
+    jidmap = realloc(jidmap, cap / 64 * sizeof(uint64_t));
+    if (jobs == NULL || jidmap == NULL)
+        unix_error("realloc error");
+    memset(&jobs[jobcap], 0, (cap - jobcap) * sizeof(struct job_t));
+    memset(&jidmap[jobcap / 64], 0, (cap - jobcap) / 64 * sizeof(uint64_t));
+    for (i = jobcap; i < cap; i++)
+        clearjob(&jobs[i]);
+    jobcap = cap;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs) 
-{
-    int i, max=0;
+/*
+ * alloc_jid - Take a job ID: one past the largest in use, or once that
+ *     reaches MAXJID, the lowest free one. Returns 0 if all are taken.
+ */
+int alloc_jid() {
+    int jid, w;
+
+    if (topjid + 1 < MAXJID) {
+        jid = topjid + 1;
+        if (jid >= jobcap)
+            growjobs(jobcap * 2);
+    } else {
+        for (w = jidhint; w < jobcap / 64; w++)
+            if (jidmap[w] != ~(uint64_t)0)
+                break;
+        jidhint = w;
+        if (w == jobcap / 64)
+            return 0;
+        jid = w * 64 + __builtin_ctzll(~jidmap[w]);
+    }
+    jidmap[jid / 64] |= (uint64_t)1 << (jid % 64);
+    if (jid > topjid)
+        topjid = jid;
+    return jid;
+}
+
+/* free_jid - Give a job ID back */
+void free_jid(int jid) {
+    int w = jid / 64;
+
+    jidmap[w] &= ~((uint64_t)1 << (jid % 64));
+    if (w < jidhint)
+        jidhint = w;
+    if (jid == topjid) {    /* bit 0 stops the search */
+        while (jidmap[w] == 0)
+            w--;
+        topjid = w * 64 + 63 - __builtin_clzll(jidmap[w]);
+    }
+}
+
+/* pidhash_slot - Home entry of pid in pidhash */
+static inline int pidhash_slot(pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) & (pidhashcap - 1);
+}
+
+/* pidhash_reserve - Make sure n more pids fit in pidhash, keeping it at most half full */
+void pidhash_reserve(int n) {
+    struct pident_t *old = pidhash;
+    int i, oldcap = pidhashcap, cap = pidhashcap ? pidhashcap : 64;
+
+    while ((npidhash + n) * 2 > cap)
+        cap *= 2;
+    if (cap == oldcap)
+        return;
+    pidhash = calloc(cap, sizeof(struct pident_t));
+    if (pidhash == NULL)
+        unix_error("calloc error");
+    pidhashcap = cap;
+    npidhash = 0;
+    for (i = 0; i < oldcap; i++)
+        if (old[i].pid != 0)
+            pidhash_put(old[i].pid, old[i].jid);
+    free(old);
+}
+
+/* pidhash_put - Record that process pid belongs to job jid */
+void pidhash_put(pid_t pid, int jid) {
+    int i = pidhash_slot(pid);
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid > max)
-            max = jobs[i].jid;
-    return max;
+    while (pidhash[i].pid != 0 && pidhash[i].pid != pid)
+        i = (i + 1) & (pidhashcap - 1);
+    if (pidhash[i].pid == 0)
+        npidhash++;
+    pidhash[i].pid = pid;
+    pidhash[i].jid = jid;
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+/* pidhash_get - Return the jid of the job process pid belongs to, 0 if none */
+int pidhash_get(pid_t pid) {
+    int i = pidhash_slot(pid);
+
+    while (pidhash[i].pid != 0) {
+        if (pidhash[i].pid == pid)
+            return pidhash[i].jid;
+        i = (i + 1) & (pidhashcap - 1);
+    }
+    return 0;
+}
+
+/*
+ * pidhash_del - Forget process pid. The entries after it in its run
+ *     are shifted back, so no tombstones are left and nothing allocates.
+ */
+void pidhash_del(pid_t pid) {
+    int mask = pidhashcap - 1;
+    int i = pidhash_slot(pid), j, k;
+
+    while (pidhash[i].pid != pid) {
+        if (pidhash[i].pid == 0)
+            return;
+        i = (i + 1) & mask;
+    }
+    for (j = (i + 1) & mask; pidhash[j].pid != 0; j = (j + 1) & mask) {
+        k = pidhash_slot(pidhash[j].pid);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;   /* its home is after the hole, it stays */
+        pidhash[i] = pidhash[j];
+        i = j;
+    }
+    pidhash[i].pid = 0;
+    npidhash--;
+}
+
+/* setjobstate - Change the state of a job, keeping fgjid and the counts current */
+void setjobstate(struct job_t *job, int state) {
+    if (job->state == FG || job->state == BG)
+        nrunning--;
+    else if (job->state == ST)
+        nstopped--;
+    if (job->state == FG)
+        fgjid = 0;
+
+    job->state = state;
+    if (state == FG || state == BG)
+        nrunning++;
+    else if (state == ST)
+        nstopped++;
+    if (state == FG)
+        fgjid = job->jid;
+}
+
+/* addjob - Add a job whose processes are pids, in group pid, to the job list */
+int addjob(pid_t pid, pid_t *pids, int npids, int state, char *cmdline)
 {
-    int i;
-    
+    struct job_t *job;
+    size_t len = strlen(cmdline) + 1;
+    int i, jid;
+
     if (pid < 1)
 	return 0;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = nextjid++;
-            if (nextjid > MAXJOBS)
-                nextjid = 1;
-            strcpy(jobs[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
-        }
+    if ((jid = alloc_jid()) == 0) {
+        printf("Tried to create too many jobs\n");
+        return 0;
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    pidhash_reserve(npids + 1);
+
+    job = &jobs[jid];
+    if (npids > job->pidcap) {
+        job->pids = realloc(job->pids, npids * sizeof(pid_t));
+        job->pidcap = npids;
+    }
+    if (len > job->cmdcap) {
+        job->cmdline = realloc(job->cmdline, len);
+        job->cmdcap = len;
+    }
+    job->pid = pid;
+    memcpy(job->pids, pids, npids * sizeof(pid_t));
+    job->npids = npids;
+    job->nlive = npids;
+    job->jid = jid;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    setjobstate(job, state);
+    memcpy(job->cmdline, cmdline, len);
+
+    pidhash_put(pid, jid);
+    for (i = 0; i < npids; i++)
+        pidhash_put(pids[i], jid);
+    if(verbose){
+        printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return 1;
 }
 
 /* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) 
+int deletejob(pid_t pid)
 {
+    struct job_t *job = getjobpid(pid);
     int i;
 
-    if (pid < 1)
+    if (job == NULL || job->pid != pid)
 	    return 0;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            clearjob(&jobs[i]);
-            nextjid = maxjid(jobs)+1;
-            return 1;
-        }
+    pidhash_del(pid);
+    for (i = 0; i < job->npids; i++)
+        if (job->pids[i] != 0)
+            pidhash_del(job->pids[i]);
+    setjobstate(job, UNDEF);
+    free_jid(job->jid);
+
+    struct donejob_t *d = &donejobs[ndone++ % PS_DONE];
+    struct timespec now;
+    size_t len = strlen(job->cmdline) + 1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    d->jid = job->jid;
+    d->pid = job->pid;
+    d->wall = (now.tv_sec - job->start.tv_sec) + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+    d->ru = job->ru;
+    if (len > d->cmdcap) {
+        d->cmdline = realloc(d->cmdline, len);
+        d->cmdcap = len;
     }
-    return 0;
+    memcpy(d->cmdline, job->cmdline, len);
+
+    clearjob(job);
+    return 1;
 }
 
 /* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
-    for (i = 0; i < MAXJOBS; i++){
-	    if (jobs[i].state == FG)
-	        return jobs[i].pid;
-    }
-    return 0;
+pid_t fgpid() {
+    return fgjid ? jobs[fgjid].pid : 0;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/* getjobpid  - Find a job (by the PID of any of its processes) on the job list */
+struct job_t *getjobpid(pid_t pid) {
+    int jid;
 
     if (pid < 1)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+    if ((jid = pidhash_get(pid)) == 0)
+        return NULL;
+    return &jobs[jid];
 }
 
 /* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
+struct job_t *getjobjid(int jid)
 {
-    int i;
-
-    if (jid < 1)
+    if (jid < 1 || jid >= jobcap || jobs[jid].pid == 0)
 	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+    return &jobs[jid];
 }
 
 /* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) 
+int pid2jid(pid_t pid)
 {
-    int i;
-
-    if (pid < 1)
-	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
-    return 0;
+    return pidhash_get(pid);
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) 
+/* listjobs - Print the job list, in jid order */
+void listjobs()
 {
-    int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid != 0) {
+    int i, w;
+    uint64_t bits;
+
+    for (w = 0; w <= topjid / 64; w++) {
+	for (bits = jidmap[w]; bits != 0; bits &= bits - 1) {
+	    i = w * 64 + __builtin_ctzll(bits);
+	    if (jobs[i].pid == 0)
+		continue;
 	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
 	    switch (jobs[i].state) {
-		case BG: 
+		case BG:
 		    printf("Running ");
 		    break;
-		case FG: 
+		case FG:
 		    printf("Foreground ");
 		    break;
-		case ST: 
+		case ST:
 		    printf("Stopped ");
 		    break;
 	    default:
-		    printf("listjobs: Internal error: job[%d].state=%d ", 
+		    printf("listjobs: Internal error: job[%d].state=%d ",
 			   i, jobs[i].state);
 	    }
 	    printf("%s", jobs[i].cmdline);
@@ -1016,10 +5347,16 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvp] [-l fork|spawn|vfork] [-r files|shm] [-H size] [-a fd] [-c command | script | -d socket]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -l   how to start commands (default: spawn)\n");
+    printf("   -r   how to record processes (default: files under ./proc)\n");
+    printf("   -H   how many commands the history keeps (default: %d)\n", HISTSIZE);
+    printf("   -a   log in with the \"user:password\" read from fd (or set TSH_AUTH)\n");
+    printf("   -c   run command instead of reading from stdin\n");
+    printf("   -d   serve login sessions on the Unix socket instead\n");
     exit(1);
 }
 